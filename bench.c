@@ -0,0 +1,268 @@
+// $ gcc bench.c -o bench
+// Build the clients next to it under their own names first, e.g.
+// $ gcc -lwayland-client square.c os_compat.c pixel.c -o square
+//
+// $ ./bench [-n frames] [-d client-dir] [-o stats-dir] [scenario...]
+//
+// Starts a private headless weston (no GPU, no desktop session needed),
+// runs every scenario under it for a fixed number of frames and reports
+// frames/sec, CPU time and peak RSS. $WESTON picks the compositor binary.
+// The clients' frame statistics (see stats.h) go to <stats-dir>/<name>.json,
+// the current directory by default. The scratch directory with the logs
+// is removed, unless anything failed.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define SOCKET_NAME "bench-wayland"
+#define STARTUP_TIMEOUT_MS 10000
+#define RUN_TIMEOUT_MS 120000
+
+struct scenario {
+  const char *name;
+  int animated; // renders until $BENCH_FRAMES, otherwise exits by itself
+};
+
+struct scenario scenarios[] = {
+  { "connect", 0 },
+  { "square", 0 },
+  { "surface_part_damage", 1 },
+  { "input", 1 }, // the headless backend has no seat: no input, just frames
+  { "clipboard", 1 },
+};
+
+char runtime_dir[] = "/tmp/bench-XXXXXX";
+const char *client_dir = ".";
+const char *stats_dir = ".";
+int frames = 600;
+pid_t weston_pid;
+
+double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sleep_ms(int ms) {
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+  nanosleep(&ts, NULL);
+}
+
+// stdout and stderr of the child go to <runtime_dir>/<name>.log
+pid_t spawn(const char *name, char *const argv[]) {
+  char path[256];
+  pid_t pid;
+  int fd;
+
+  pid = fork();
+  if (pid != 0) return pid;
+
+  snprintf(path, sizeof(path), "%s/%s.log", runtime_dir, name);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd >= 0) {
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+  }
+
+  execvp(argv[0], argv);
+  fprintf(stderr, "Could not run %s: %m\n", argv[0]);
+  _exit(127);
+}
+
+// -1 if it did not exit in time; it gets killed then
+int wait_child(pid_t pid, int timeout_ms, int *status, struct rusage *ru) {
+  double deadline = now() + timeout_ms / 1000.0;
+  pid_t ret;
+
+  while ((ret = wait4(pid, status, WNOHANG, ru)) == 0) {
+    if (now() > deadline) {
+      kill(pid, SIGKILL);
+      wait4(pid, status, 0, ru);
+      return -1;
+    }
+    sleep_ms(5);
+  }
+
+  return ret == pid ? 0 : -1;
+}
+
+void start_weston() {
+  const char *weston = getenv("WESTON") ? getenv("WESTON") : "weston";
+  char *argv[] = {
+    (char *)weston, "--backend=headless", "--socket=" SOCKET_NAME, "--idle-time=0", NULL
+  };
+  char socket_path[256];
+  struct stat st;
+  double deadline = now() + STARTUP_TIMEOUT_MS / 1000.0;
+  int status;
+
+  weston_pid = spawn("weston", argv);
+  if (weston_pid < 0) {
+    perror("Could not start weston");
+    exit(1);
+  }
+
+  // it is up once the socket is there
+  snprintf(socket_path, sizeof(socket_path), "%s/%s", runtime_dir, SOCKET_NAME);
+  while (stat(socket_path, &st) < 0) {
+    if (waitpid(weston_pid, &status, WNOHANG) == weston_pid) {
+      fprintf(stderr, "weston exited during startup, see %s/weston.log\n", runtime_dir);
+      exit(1);
+    }
+    if (now() > deadline) {
+      fprintf(stderr, "weston did not come up, see %s/weston.log\n", runtime_dir);
+      kill(weston_pid, SIGKILL);
+      exit(1);
+    }
+    sleep_ms(10);
+  }
+}
+
+void stop_weston() {
+  int status;
+  struct rusage ru;
+
+  kill(weston_pid, SIGTERM);
+  if (wait_child(weston_pid, 5000, &status, &ru) < 0) fprintf(stderr, "weston had to be killed\n");
+}
+
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+// The client's own frame rate, first frame to last (see stats.h). -1: none.
+double read_fps(const char *stats_file) {
+  char buf[4096], *p;
+  double fps = -1;
+  size_t n;
+  FILE *f;
+
+  f = fopen(stats_file, "r");
+  if (!f) return -1;
+  n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = '\0';
+
+  p = strstr(buf, "\"fps\":");
+  if (p) sscanf(p + strlen("\"fps\":"), "%lf", &fps);
+  return fps;
+}
+
+// Returns 0 on success
+int run(struct scenario *sc) {
+  char binary[512], stats_file[256], frames_env[32];
+  char *argv[] = { binary, NULL };
+  struct rusage ru;
+  double start, wall, cpu, fps;
+  int status, ret;
+  pid_t pid;
+
+  snprintf(binary, sizeof(binary), "%s/%s", client_dir, sc->name);
+  if (access(binary, X_OK) < 0) {
+    printf("%-20s %8s\n", sc->name, "missing");
+    return 1;
+  }
+
+  snprintf(stats_file, sizeof(stats_file), "%s/%s.json", stats_dir, sc->name);
+  snprintf(frames_env, sizeof(frames_env), "%d", frames);
+  setenv("STATS_FILE", stats_file, 1);
+  setenv("BENCH_FRAMES", frames_env, 1);
+
+  start = now();
+  pid = spawn(sc->name, argv);
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  ret = wait_child(pid, RUN_TIMEOUT_MS, &status, &ru);
+  wall = now() - start;
+
+  cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+  if (ret < 0) {
+    printf("%-20s %8s\n", sc->name, "timeout");
+    return 1;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("%-20s %8s  see %s/%s.log\n", sc->name, "failed", runtime_dir, sc->name);
+    return 1;
+  }
+
+  if (sc->animated && (fps = read_fps(stats_file)) >= 0) {
+    printf("%-20s %8s %10.3f %10.1f %10.3f %10ld\n", sc->name, "ok", wall, fps, cpu, ru.ru_maxrss);
+  } else {
+    printf("%-20s %8s %10.3f %10s %10.3f %10ld\n", sc->name, "ok", wall, "-", cpu, ru.ru_maxrss);
+  }
+  return 0;
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-n frames] [-d client-dir] [-o stats-dir] [scenario...]\n", argv0);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int opt, i, j, failed = 0, found;
+
+  while ((opt = getopt(argc, argv, "n:d:o:")) != -1) {
+    switch (opt) {
+    case 'n':
+      frames = atoi(optarg);
+      if (frames <= 0) usage(argv[0]);
+      break;
+    case 'd':
+      client_dir = optarg;
+      break;
+    case 'o':
+      stats_dir = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0); // rows show up as scenarios finish
+
+  if (mkdtemp(runtime_dir) == NULL) {
+    perror("Could not create the runtime directory");
+    exit(1);
+  }
+  // everything we start talks to our weston and nothing else
+  setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+  setenv("WAYLAND_DISPLAY", SOCKET_NAME, 1);
+  unsetenv("DISPLAY");
+
+  start_weston();
+
+  printf("%-20s %8s %10s %10s %10s %10s\n", "scenario", "status", "wall_s", "fps", "cpu_s", "maxrss_kb");
+  for (i = 0; i < (int)(sizeof(scenarios) / sizeof(scenarios[0])); i++) {
+    found = optind == argc;
+    for (j = optind; j < argc; j++) {
+      if (strcmp(argv[j], scenarios[i].name) == 0) found = 1;
+    }
+    if (found) failed |= run(&scenarios[i]);
+  }
+
+  stop_weston();
+
+  if (failed) {
+    fprintf(stderr, "logs kept in %s\n", runtime_dir);
+  } else {
+    nftw(runtime_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  return failed;
+}
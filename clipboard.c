@@ -1,3 +1,5 @@
+// $ gcc -lwayland-client clipboard.c shm_pool.c os_compat.c pixel.c damage.c region.c raster.c pointer.c hitmap.c stats.c log.c event_loop.c key_repeat.c keymap_cache.c receive.c transfer.c sender.c mime.c history.c -lpthread -lxkbcommon
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,27 +7,48 @@
 #include <wayland-client-protocol.h>
 #include <sys/mman.h>
 #include <sys/epoll.h>
-#include <poll.h>
 #include <errno.h>
 #include <linux/input.h>
 #define _GNU_SOURCE
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
+
+#include "shm_pool.h"
+#include "pixel.h"
+#include "damage.h"
+#include "raster.h"
+#include "pointer.h"
+#include "hitmap.h"
+#include "stats.h"
+#include "log.h"
+#include "event_loop.h"
+#include "key_repeat.h"
+#include "keymap_cache.h"
+#include "transfer.h"
+#include "sender.h"
+#include "mime.h"
+#include "history.h"
 
 unsigned win_width = 400;
 unsigned win_height = 400;
 
 struct wl_display *display;
 struct wl_compositor *compositor;
+uint32_t compositor_version;
 struct wl_surface *surface;
 struct wl_shell *shell;
 struct wl_shell_surface *shell_surface;
 struct wl_shm *shm;
-struct wl_buffer *buffer;
+struct shm_pool *pool;
 struct wl_callback *frame_callback;
 struct wl_seat *seat;
 struct wl_pointer *pointer;
+struct pointer_frames *pointer_frames;
 struct wl_keyboard *keyboard;
+struct key_repeat *key_repeat;
+struct keymap_cache *keymap_cache;
+uint32_t key_serial; // of the latest press
 struct wl_data_device_manager *data_device_man;
 struct wl_data_device *data_device;
 struct wl_data_offer *data_offer;
@@ -33,141 +56,121 @@ struct wl_data_source *data_source;
 struct wl_data_offer *drag_offer;
 struct wl_data_source *drag_source;
 
-void *shm_data;
-char *clipboard, *drag_content;
-size_t clipboard_size, drag_content_size;
-int clipboard_fd, drag_fd;
-char *copy_text;
-int epfd;
+int waiting_for_buffer;
+struct raster *raster;
+struct shm_buffer *painting; // submitted to the raster, not committed yet
+struct stats *stats;
+struct event_loop *loop;
+struct transfers *transfers; // what we are receiving
+struct history history; // of the selections we pasted
+struct payload *pasted; // what the current selection gave us, if we pasted it already
+struct sender *sender; // what we are sending as a data source
 uint32_t drag_enter_serial;
 uint32_t drag_action;
 
-// Dealing with tmpfiles
-int set_cloexec_or_close(int fd) {
-  long flags;
-  if (fd == -1) return -1;
-  
-  flags = fcntl(fd, F_GETFD);
-  if (flags == -1) {
-    close(fd);
-    return -1;
-  }
+struct damage frame_damage; // what changed since the previous commit
 
-  if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
-    close(fd);
-    return -1;
-  }
+static const struct wl_callback_listener frame_listener;
+
+// The raster is done with the tiles of `painting`: hand it over.
+void commit_frame() {
+  struct shm_buffer *buf = painting;
+
+  painting = NULL;
+  damage_send(&frame_damage, surface, compositor_version);
+  stats_commit(stats);
+  damage_clear(&frame_damage);
 
-  return fd;
+  frame_callback = wl_surface_frame(surface);
+  wl_surface_attach(surface, buf->buffer, 0, 0);
+  wl_callback_add_listener(frame_callback, &frame_listener, NULL);
+  wl_surface_commit(surface);
 }
 
-int create_tmpfile_cloexec(char *tmpname) {
-#ifdef HAVE_MKOSTEMP
-  int fd = mkostemp(tmpname, O_CLOEXEC);
-  if (fd >= 0) unlink(tmpname);
-#else
-  int fd = mkstemp(tmpname);
-  if (fd >= 0) {
-    fd = set_cloexec_or_close(fd);
-    unlink(tmpname);
-  }
-#endif
+void paint_tile(void *data, const struct box *tile) {
+  struct shm_buffer *buf = data;
 
-  return fd;
+  pixel_fill_rect(shm_buffer_data(buf), buf->pool->stride, tile->x1, tile->y1, tile->x2 - tile->x1, tile->y2 - tile->y1, 0xff000000);
 }
 
-int os_create_anonymous_file(off_t size) { // from Weston's implementation
-  static const char template[] = "/weston-shared-XXXXXX";
-  const char *path;
-  char *name;
-  int fd;
+// Only rasterize what this buffer has missed since it was last attached.
+// The tiles are painted on the raster threads; the dispatch thread goes
+// back to handling events and commits when raster_get_fd() fires.
+void paint_pixels(struct shm_buffer *buf) {
+  const struct box *b;
+  int i, n;
 
-  path = getenv("XDG_RUNTIME_DIR");
-  if (!path) {
-    errno = ENOENT;
-    return -1;
+  painting = buf;
+  b = damage_boxes(&buf->damage, &n);
+  if (raster_submit(raster, b, n, paint_tile, buf) < 0) {
+    for (i = 0; i < n; i++) paint_tile(buf, &b[i]);
+    damage_clear(&buf->damage);
+    commit_frame();
+    return;
   }
+  damage_clear(&buf->damage); // the raster has its own copy of the boxes
+}
 
-  name = malloc(strlen(path) + sizeof(template));
-  if (!name) return -1;
-  strcpy(name, path);
-  strcat(name, template); // name += template
+uint32_t ht;
 
-  fd = create_tmpfile_cloexec(name);
-  free(name);
-  if (fd < 0) return -1;
-  if (ftruncate(fd, size) < 0) {
-    close(fd);
-    return -1;
-  }
+void dnd_flush();
 
-  return fd;
-}
+void redraw(void *data, struct wl_callback *callback, uint32_t time) {
+  struct shm_buffer *buf;
+
+  if (frame_callback) wl_callback_destroy(frame_callback);
+  frame_callback = NULL;
 
-void paint_pixels() {
-  int n;
-  uint32_t *pixel = shm_data;
+  dnd_flush();
 
-  for (n = 0; n < win_width * win_height; n++) {
-    pixel[n] = 0xff000000;
+  buf = shm_pool_next_buffer(pool);
+  if (buf == NULL) {
+    // the compositor holds every buffer; buffer_released() picks it up again
+    waiting_for_buffer = 1;
+    return;
   }
-}
 
-static const struct wl_callback_listener frame_listener;
+  stats_paint_begin(stats);
+  paint_pixels(buf); // commit_frame() follows once the tiles are done
+}
 
-uint32_t ht;
+void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+  wl_callback_destroy(callback);
+  frame_callback = NULL;
 
-void redraw(void *data, struct wl_callback *callback, uint32_t time) {
-  wl_callback_destroy(frame_callback);
-  wl_surface_damage(surface, 0, 0, win_width, win_height);
-  paint_pixels();
-  frame_callback = wl_surface_frame(surface);
-  wl_surface_attach(surface, buffer, 0, 0);
-  wl_callback_add_listener(frame_callback, &frame_listener, NULL);
-  wl_surface_commit(surface);
+  if (stats_frame_done(stats)) {
+    event_loop_quit(loop);
+    return;
+  }
+  redraw(NULL, NULL, time);
 }
 
 static const struct wl_callback_listener frame_listener = {
-  redraw
+  frame_done
 };
 
-struct wl_buffer *create_buffer() {
-  struct wl_shm_pool *pool;
-  int line = win_width * 4; // 4 bytes/px
-  int size = line * win_height;
-  int fd;
-  struct wl_buffer *buf;
-
-  ht = win_height;
-
-  fd = os_create_anonymous_file(size);
-  if (fd < 0) {
-    printf("Failed to create a buffer which has the size of %d\n", size);
-    exit(1);
-  }
-
-  shm_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (shm_data == MAP_FAILED) {
-    printf("mmap failed: %m\n");
-    close(fd);
-    exit(1);
+void buffer_released(void *data, struct shm_buffer *buf) {
+  if (waiting_for_buffer) {
+    waiting_for_buffer = 0;
+    redraw(NULL, NULL, 0);
   }
+}
 
-  pool = wl_shm_create_pool(shm, fd, size);
-  buf = wl_shm_pool_create_buffer(pool, 0, win_width, win_height, line, WL_SHM_FORMAT_ARGB8888);
-  
-  wl_shm_pool_destroy(pool);
-  return buf;
+struct shm_pool *create_pool() {
+  struct shm_pool *p = shm_pool_create(shm, win_width, win_height, WL_SHM_FORMAT_ARGB8888, 2); // double buffering
+  if (p == NULL) exit(1);
+  p->release = buffer_released;
+  return p;
 }
 
 void create_window() {
-  buffer = create_buffer();
-  wl_surface_attach(surface, buffer, 0, 0);
-  wl_surface_commit(surface);
+  ht = win_height;
+  pool = create_pool();
+  damage_add(&frame_damage, 0, 0, win_width, win_height);
 }
 
 void shm_format(void *data, struct wl_shm *wl_shm, uint32_t format) {
-  printf("Format %d\n", format);
+  log_debug("Format %d\n", format);
 }
 
 struct wl_shm_listener shm_listener = {
@@ -175,29 +178,107 @@ struct wl_shm_listener shm_listener = {
 };
 
 void keymap(void *data, struct wl_keyboard *kbd, uint32_t format, int32_t fd, uint32_t size) {
-
+  if (keymap_cache_load(keymap_cache, format, fd, size) < 0) log_warn("Could not load the keymap (format %u)\n", format);
 }
 
 void keyboard_enter(void *data, struct wl_keyboard *kbd, uint32_t serial, struct wl_surface *sfc, struct wl_array *keys) {
-  printf("Keyboard entered a surface\n");
+  log_info("Keyboard entered a surface\n");
 }
 
 void keyboard_leave(void *data, struct wl_keyboard *kbd, uint32_t serial, struct wl_surface *sfc) {
-  printf("Keyboard left the surface\n");
+  log_info("Keyboard left the surface\n");
+  key_repeat_stop(key_repeat);
 }
 
 struct wl_data_source_listener data_source_listener;
 
+// Text types we can take, cheapest first: the UTF-8 we use as it is (under
+// its MIME and its X11 name), then plain ASCII
+const char *const text_types[] = { "text/plain;charset=utf-8", "UTF8_STRING", "text/plain", "TEXT", "STRING" };
+#define N_TEXT_TYPES (sizeof(text_types) / sizeof(text_types[0]))
+
+const char *text_type(struct wl_data_offer *offer) {
+  return mime_offer_pick(wl_data_offer_get_user_data(offer), text_types, N_TEXT_TYPES);
+}
+
+// Along with whatever was still coming from it
+void destroy_offer(struct wl_data_offer *offer) {
+  if (!offer) return;
+  transfers_cancel(transfers, offer);
+  mime_offer_destroy(wl_data_offer_get_user_data(offer));
+  wl_data_offer_destroy(offer);
+}
+
+// What we offer besides the UTF-8 text (`data`), made when first asked for
+
+struct payload *to_ascii(const char *type, void *data) {
+  struct payload *text = data, *p;
+  char *out = malloc(text->len + 1);
+  size_t i, n = 0;
+
+  if (!out) return NULL;
+  for (i = 0; i < text->len; i++) {
+    unsigned char c = text->data[i];
+    if (c < 0x80) out[n++] = c;
+    else if ((c & 0xc0) != 0x80) out[n++] = '?'; // one per character, not per byte
+  }
+
+  p = payload_create(out, n);
+  free(out);
+  return p;
+}
+
+struct payload *to_html(const char *type, void *data) {
+  static const char head[] = "<meta charset=\"utf-8\"><pre>", tail[] = "</pre>";
+  struct payload *text = data, *p;
+  char *out = malloc(sizeof(head) + text->len * 5 + sizeof(tail)); // "&amp;" is the longest
+  size_t i, n = 0;
+
+  if (!out) return NULL;
+  memcpy(out, head, sizeof(head) - 1);
+  n = sizeof(head) - 1;
+  for (i = 0; i < text->len; i++) {
+    switch (text->data[i]) {
+    case '<': memcpy(out + n, "&lt;", 4); n += 4; break;
+    case '>': memcpy(out + n, "&gt;", 4); n += 4; break;
+    case '&': memcpy(out + n, "&amp;", 5); n += 5; break;
+    default: out[n++] = text->data[i];
+    }
+  }
+  memcpy(out + n, tail, sizeof(tail) - 1);
+  n += sizeof(tail) - 1;
+
+  p = payload_create(out, n);
+  free(out);
+  return p;
+}
+
+// Each data source carries its own types (the listener data), released
+// along with the source.
+struct mime_source *text_source(const char *text) {
+  struct payload *utf8 = payload_create(text, strlen(text)); // ignore trailing '\0'
+  struct mime_source *s = utf8 ? mime_source_create() : NULL;
+
+  if (!s) {
+    payload_unref(utf8);
+    return NULL;
+  }
+  mime_source_add(s, "text/plain;charset=utf-8", utf8);
+  mime_source_add(s, "UTF8_STRING", utf8);
+  mime_source_add_converter(s, "text/plain", to_ascii, utf8);
+  mime_source_add_converter(s, "text/html", to_html, utf8);
+  payload_unref(utf8); // the entries above keep it
+  return s;
+}
+
 void drag(uint32_t serial) {
-  char text[] = "way way wayland";
-  if (copy_text) free(copy_text);
-  copy_text = (char *)malloc(strlen(text));
-  memcpy(copy_text, text, strlen(text)); // ignore tailing '\0'
+  struct mime_source *mime = text_source("way way wayland");
+
+  if (!mime) return;
 
   drag_source = wl_data_device_manager_create_data_source(data_device_man);
-  wl_data_source_offer(drag_source, "text/plain;charset=utf-8");
-  wl_data_source_offer(drag_source, "UTF8_STRING");
-  wl_data_source_add_listener(drag_source, &data_source_listener, NULL);
+  mime_source_offer(mime, drag_source);
+  wl_data_source_add_listener(drag_source, &data_source_listener, mime);
 
   wl_data_source_set_actions(drag_source, WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE | WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY | WL_DATA_DEVICE_MANAGER_DND_ACTION_ASK);
 
@@ -205,64 +286,145 @@ void drag(uint32_t serial) {
 }
 
 void copy(const char *text, uint32_t serial) {
-  if (copy_text) free(copy_text);
-  copy_text = (char *)malloc(strlen(text));
-  memcpy(copy_text, text, strlen(text)); // ignore trailing '\0'
+  struct mime_source *mime = text_source(text);
+
+  if (!mime) return;
 
   data_source = wl_data_device_manager_create_data_source(data_device_man);
-  wl_data_source_offer(data_source, "text/plain;charset=utf-8");
-  wl_data_source_offer(data_source, "UTF8_STRING");
-  wl_data_source_add_listener(data_source, &data_source_listener, NULL);
+  mime_source_offer(mime, data_source);
+  wl_data_source_add_listener(data_source, &data_source_listener, mime);
   
   wl_data_device_set_selection(data_device, data_source, serial);
 }
 
+void log_received(const char *what, const char *data, size_t len) {
+  char preview[64];
+  size_t n = len < sizeof(preview) - 1 ? len : sizeof(preview) - 1;
+
+  if (n > 0) memcpy(preview, data, n);
+  preview[n] = '\0';
+  log_info("%s %zu bytes: %s%s\n", what, len, preview, n < len ? "..." : "");
+}
+
+// Logs how a transfer ended; the payload, if it made it
+const char *transfer_result(struct transfer *t, int status) {
+  const char *p;
+
+  switch (status) {
+  case TRANSFER_DONE:
+    p = receive_map(&t->receive);
+    if (p) log_received(t->mime, p, t->receive.len);
+    return p;
+  case TRANSFER_CANCELLED:
+    log_info("%s: cancelled after %zu bytes\n", t->mime, t->receive.len);
+    return NULL;
+  case TRANSFER_TIMED_OUT:
+    log_warn("%s: the source stalled after %zu bytes\n", t->mime, t->receive.len);
+    return NULL;
+  default:
+    log_warn("%s: failed after %zu bytes\n", t->mime, t->receive.len);
+    return NULL;
+  }
+}
+
+// The same selection pastes from memory from now on. (Transfers from an
+// older selection were cancelled along with its offer.)
+void selection_received(void *data, struct transfer *t, int status) {
+  const char *p = transfer_result(t, status);
+  struct payload *cached;
+
+  if (!p) return;
+
+  cached = history_add(&history, p, t->receive.len);
+  log_debug("history: %d entries, %zu bytes, %d deduplicated\n", history.count, history.bytes, history.deduplicated);
+  payload_unref(pasted);
+  pasted = cached ? payload_ref(cached) : NULL;
+
+  receive_unmap(&t->receive, p);
+}
+
+void drop_received(void *data, struct transfer *t, int status) {
+  const char *p = transfer_result(t, status);
+
+  if (p) receive_unmap(&t->receive, p);
+}
+
 void paste() {
-  int fd[2], nfd;
-  struct epoll_event ev;
+  const char *type;
   
   if (!data_offer) return;
-
-  if (pipe2(fd, __O_CLOEXEC) == -1) return;
+  if (pasted) {
+    log_received("pasted (from the cache)", pasted->data, pasted->len);
+    return;
+  }
+  type = text_type(data_offer);
+  if (!type) {
+    log_info("nothing we can paste in there\n");
+    return;
+  }
 
   // see: https://eklitzke.org/blocking-io-nonblocking-io-and-epoll
-  ev.events = EPOLLIN;
-  ev.data.fd = clipboard_fd = fd[0];
-  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd[0], &ev) == -1) {
-    perror("Could not add fd[0]");
-    exit(1);
+  if (!transfers_receive(transfers, data_offer, type, selection_received, NULL)) {
+    log_warn("Could not start the transfer\n");
+    return;
   }
 
-  wl_data_offer_receive(data_offer, "text/plain;charset=utf-8", fd[1]);
-  close(fd[1]); // the source client closes fd[1], doesn't it?
-
-  fprintf(stderr, "wait for the source client / the clipboard manager to send the data...\n");
+  log_info("wait for the source client / the clipboard manager to send the data...\n");
 }
 
-void key(void *data, struct wl_keyboard *kbd, uint32_t serial, uint32_t time, uint32_t key, uint32_t state) {
-  printf("%d was %s\n", key, state == WL_KEYBOARD_KEY_STATE_PRESSED ? "pressed" : "released");
+void key_down(uint32_t key, uint32_t serial) {
+  const struct keymap_key *k = keymap_cache_lookup(keymap_cache, key);
+  xkb_keysym_t sym = k ? k->sym : XKB_KEY_NoSymbol;
 
-  if (key == KEY_C && state == WL_KEYBOARD_KEY_STATE_PRESSED) { // copy on keydown
-    fprintf(stderr, "Copy\n");
+  if (sym == XKB_KEY_c || sym == XKB_KEY_C) { // copy on keydown
+    log_info("Copy\n");
     char m[64];
     snprintf(m, 64, "way way wayland %u", serial);
     copy(m, serial);
   }
 
-  if (key == KEY_V && state == WL_KEYBOARD_KEY_STATE_PRESSED) { // paste on keydown
+  if (sym == XKB_KEY_v || sym == XKB_KEY_V) { // paste on keydown
     paste();
   }
+
+  if (sym == XKB_KEY_h) {
+    struct payload *p;
+    int i;
+
+    for (i = 0; (p = history_get(&history, i)); i++) log_received(i == 0 ? "history (latest)" : "history", p->data, p->len);
+  }
+}
+
+void key(void *data, struct wl_keyboard *kbd, uint32_t serial, uint32_t time, uint32_t key, uint32_t state) {
+  log_info("%d was %s\n", key, state == WL_KEYBOARD_KEY_STATE_PRESSED ? "pressed" : "released");
+
+  const struct keymap_key *k = keymap_cache_lookup(keymap_cache, key);
+
+  if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+    key_serial = serial;
+    key_down(key, serial);
+  }
+  if (state == WL_KEYBOARD_KEY_STATE_RELEASED || !k || k->repeats) key_repeat_key(key_repeat, key, state);
+}
+
+// A held key acts again, with the serial of its press. Repeats that piled
+// up while we were busy come as one `count` and act once.
+void key_repeated(void *data, uint32_t key, uint32_t count) {
+  log_debug("%d repeated (x%u)\n", key, count);
+  key_down(key, key_serial);
 }
 
 void modifiers(void *data, struct wl_keyboard *kbd, uint32_t serial, uint32_t mods_depressed, uint32_t mods_latched, uint32_t mods_locked, uint32_t group) {
-  // printf(
+  keymap_cache_set_modifiers(keymap_cache, mods_depressed, mods_latched, mods_locked, group);
+  // log_info(
   //   "Mods Depressed: %d\n"
   //   "Mods Latched: %d\n"
   //   "Mods Locked: %d\n", mods_depressed, mods_latched, mods_locked);
 }
 
 void repeat_info(void *data, struct wl_keyboard *kbd, int32_t rate, int32_t delay) {
-
+  log_info("Key repeat: %d/s after %dms\n", rate, delay);
+  key_repeat_set_info(key_repeat, rate, delay);
 }
 
 struct wl_keyboard_listener keyboard_listener = {
@@ -274,16 +436,7 @@ struct wl_keyboard_listener keyboard_listener = {
   repeat_info
 };
 
-void pointer_enter(void *data, struct wl_pointer *ptr, uint32_t serial, struct wl_surface *sfc, wl_fixed_t sfc_x, wl_fixed_t sfc_y) {
-}
-
-void pointer_leave(void *data, struct wl_pointer *ptr, uint32_t serial, struct wl_surface *sfc) {
-}
-
-void motion(void *data, struct wl_pointer *ptr, uint32_t time, wl_fixed_t sfc_x, wl_fixed_t sfc_y) {
-}
-
-void button(void *data, struct wl_pointer *ptr, uint32_t serial, uint32_t time, uint32_t button, uint32_t state) {
+void button(uint32_t serial, uint32_t button, uint32_t state) {
   if (button == BTN_LEFT && state == WL_POINTER_BUTTON_STATE_PRESSED) {
     drag(serial);
   }
@@ -293,38 +446,19 @@ void button(void *data, struct wl_pointer *ptr, uint32_t serial, uint32_t time,
   }
 }
 
-void axis(void *data, struct wl_pointer *ptr, uint32_t time, uint32_t axis, wl_fixed_t value) {
-  printf("Axis: %d %d\n", axis, value);
-}
+// One call per wl_pointer.frame (see pointer.h)
+void pointer_frame(void *data, const struct pointer_event *ev) {
+  int i;
 
-void frame(void *data, struct wl_pointer *ptr) {
-  // printf("-- Frame Ended --\n");
-}
-
-void axis_source(void *data, struct wl_pointer *ptr, uint32_t axis_source) {
-  printf("Axis source: %d", axis_source);
-}
-
-void axis_stop(void *data, struct wl_pointer *ptr, uint32_t time, uint32_t axis) {
-  printf("Axis stopped: %d", axis);
-}
+  for (i = 0; i < ev->nbuttons; i++) button(ev->buttons[i].serial, ev->buttons[i].button, ev->buttons[i].state);
 
-void axis_discrete(void *data, struct wl_pointer *ptr, uint32_t axis, int32_t discrete) {
-  printf("Axis discrete: %d %d", axis, discrete);
+  if (ev->mask & POINTER_AXIS) {
+    log_info("Axis: %d %d (discrete %d %d)\n", ev->axis[0], ev->axis[1], ev->discrete[0], ev->discrete[1]);
+  }
+  if (ev->mask & POINTER_AXIS_SOURCE) log_info("Axis source: %d\n", ev->axis_source);
+  if (ev->mask & POINTER_AXIS_STOP) log_info("Axis stopped: %d\n", ev->axis_stop);
 }
 
-struct wl_pointer_listener pointer_listener = {
-  .enter = pointer_enter,
-  .leave = pointer_leave,
-  .motion = motion,
-  .button = button,
-  .axis = axis,
-  .frame = frame,
-  .axis_source = axis_source,
-  .axis_stop = axis_stop,
-  .axis_discrete = axis_discrete
-};
-
 void seat_capabilities(void *data, struct wl_seat *seat, uint32_t capabilities) {
   if ((capabilities & WL_SEAT_CAPABILITY_KEYBOARD) && !keyboard) {
     keyboard = wl_seat_get_keyboard(seat);
@@ -332,23 +466,29 @@ void seat_capabilities(void *data, struct wl_seat *seat, uint32_t capabilities)
   }
 
   if (!(capabilities & WL_SEAT_CAPABILITY_KEYBOARD) && keyboard) {
+    key_repeat_stop(key_repeat);
     wl_keyboard_release(keyboard);
+    keyboard = NULL;
   }
 
   if ((capabilities & WL_SEAT_CAPABILITY_POINTER) && !pointer) {
     pointer = wl_seat_get_pointer(seat);
-    wl_pointer_add_listener(pointer, &pointer_listener, NULL);
+    pointer_frames = pointer_frames_create(pointer, pointer_frame, NULL);
+    if (pointer_frames == NULL) exit(1);
   }
 
   if (!(capabilities & WL_SEAT_CAPABILITY_POINTER) && pointer) {
+    pointer_frames_destroy(pointer_frames);
+    pointer_frames = NULL;
     wl_pointer_release(pointer);
+    pointer = NULL;
   }
 
   // ignore touchpad etc.
 }
 
 void seat_name(void *data, struct wl_seat *seat, const char *name) {
-  printf("Seat name: %s", name);
+  log_info("Seat name: %s", name);
 }
 
 struct wl_seat_listener seat_listener = {
@@ -357,30 +497,31 @@ struct wl_seat_listener seat_listener = {
 };
 
 void data_offer_offer(void *data, struct wl_data_offer *offer, const char *mime_type) {
-  fprintf(stderr, "[data_offer(%p).offer] MIME type: %s\n", offer, mime_type);
+  log_info("[data_offer(%p).offer] MIME type: %s\n", offer, mime_type);
+  mime_offer_add(data, mime_type);
 }
 
 void data_offer_source_actions(void *data, struct wl_data_offer *offer, uint32_t source_actions) {
-  fprintf(stderr, "[data_offer(%p).source_actions] %u\n", offer, source_actions);
+  log_info("[data_offer(%p).source_actions] %u\n", offer, source_actions);
 }
 
 void data_offer_action(void *data, struct wl_data_offer *offer, uint32_t action) {
   drag_action = action;
   switch (action) {
     case WL_DATA_DEVICE_MANAGER_DND_ACTION_NONE:
-      fprintf(stderr, "[data_offer.action] none\n");
+      log_info("[data_offer.action] none\n");
       break;
     case WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY:
-      fprintf(stderr, "[data_offer.action] copy\n");
+      log_info("[data_offer.action] copy\n");
       break;
     case WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE:
-      fprintf(stderr, "[data_offer.action] move\n");
+      log_info("[data_offer.action] move\n");
       break;
     case WL_DATA_DEVICE_MANAGER_DND_ACTION_ASK:
-      fprintf(stderr, "[data_offer.action] ask\n");
+      log_info("[data_offer.action] ask\n");
       break;
     default:
-      fprintf(stderr, "[data_offer.action] unreachable\n");
+      log_info("[data_offer.action] unreachable\n");
   }
 }
 
@@ -391,20 +532,30 @@ struct wl_data_offer_listener data_offer_listener = {
 };
 
 void data_source_target(void *data, struct wl_data_source *dsrc, const char *mime_type) {
-  fprintf(stderr, "[data_source.target] MIME type: %s\n", mime_type);
-  // ignore types as we only use text/plain;charset=utf-8
+  log_info("[data_source.target] MIME type: %s\n", mime_type);
+  // nothing to prepare: the other types are converted once asked for
 }
 
 // the procedure is common between dnds and selections
+// (the rest goes out from the event loop if the pipe fills up, see sender.h)
 void data_source_send(void *data, struct wl_data_source *dsrc, const char *mime_type, int32_t fd) {
-  fprintf(stderr, "[data_source.send] %s in %s\n", copy_text, mime_type);
-  write(fd, copy_text, strlen(copy_text)); // ignore the tailing '\0'
-  close(fd);
+  struct mime_source *mime = data;
+  struct payload *payload = mime_source_get(mime, mime_type);
+
+  if (!payload) {
+    log_warn("[data_source.send] nothing in %s\n", mime_type);
+    close(fd);
+    return;
+  }
+
+  log_info("[data_source.send] %zu bytes in %s (%d conversions so far)\n", payload->len, mime_type, mime->conversions);
+  if (sender_send(sender, payload, fd) < 0) log_warn("[data_source.send] the receiver went away\n");
 }
 
 void data_source_cancelled(void *data, struct wl_data_source *old_dsrc) {
-  fprintf(stderr, "[data_source.cancelled]\n");
+  log_info("[data_source.cancelled]\n");
   wl_data_source_destroy(old_dsrc);
+  mime_source_destroy(data); // transfers in flight keep their own reference
 }
 
 void data_source_dnd_drop_performed(void *data, struct wl_data_source *dsrc) {
@@ -413,6 +564,7 @@ void data_source_dnd_drop_performed(void *data, struct wl_data_source *dsrc) {
 
 void data_source_dnd_finished(void *data, struct wl_data_source *dsrc) {
   wl_data_source_destroy(dsrc);
+  mime_source_destroy(data);
 }
 
 void data_source_action(void *data, struct wl_data_source *dsrc, uint32_t dnd_action) {
@@ -428,86 +580,160 @@ struct wl_data_source_listener data_source_listener = {
   .action = data_source_action
 };
 
-uint32_t saved_actions;
-uint32_t dnd_action_at(wl_fixed_t x, wl_fixed_t y) {
-  int sx = x >> 8, sy = y >> 8;
+struct hitmap drop_zones;
 
-  // left top
-  if (sx < 200 && sy < 200) return WL_DATA_DEVICE_MANAGER_DND_ACTION_NONE;
-  
-  // left bottom
-  if (sx < 200 && sy >= 200) return WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY;
+enum drop_zone {
+  ZONE_LEFT_TOP,
+  ZONE_LEFT_BOTTOM,
+  ZONE_RIGHT_TOP,
+  ZONE_RIGHT_BOTTOM,
+  ZONE_COUNT
+};
+
+// The action of each zone, resolved with the layout
+uint32_t zone_action[ZONE_COUNT] = {
+  WL_DATA_DEVICE_MANAGER_DND_ACTION_NONE,
+  WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY,
+  WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE,
+  WL_DATA_DEVICE_MANAGER_DND_ACTION_ASK
+};
 
-  // right top
-  if (sx >= 200 && sy < 200) return WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE;
+// One quadrant of the window per action
+void layout_drop_zones() {
+  int w = win_width, h = win_height;
+
+  hitmap_reset(&drop_zones, w, h);
+  hitmap_add(&drop_zones, 0, 0, w / 2, h / 2, ZONE_LEFT_TOP);
+  hitmap_add(&drop_zones, 0, h / 2, w / 2, h - h / 2, ZONE_LEFT_BOTTOM);
+  hitmap_add(&drop_zones, w / 2, 0, w - w / 2, h / 2, ZONE_RIGHT_TOP);
+  hitmap_add(&drop_zones, w / 2, h / 2, w - w / 2, h - h / 2, ZONE_RIGHT_BOTTOM);
+  if (hitmap_build(&drop_zones) < 0) {
+    perror("Could not lay out the drop zones\n");
+    exit(1);
+  }
+}
 
-  // right bottom
-  if (sx >= 200 && sy >= 200) return WL_DATA_DEVICE_MANAGER_DND_ACTION_ASK;
+// What we tell the drag source, as a drop target. Motion is only looked at
+// once per frame of ours (see dnd_flush()), the zone under it decides the
+// action, and a request only goes out when it would say something new.
+struct dnd_target {
+  int pending; // motion since the last flush
+  wl_fixed_t x, y;
+  int zone; // -1: none yet
+  uint32_t actions; // as last sent
+  const char *mime; // the one we accept from this offer
+  int accepted; // sent it already
+
+  // since the enter
+  uint32_t motions, evaluated, requests, suppressed;
+} dnd;
+
+void dnd_set_actions(uint32_t actions) {
+  if (actions == dnd.actions) {
+    dnd.suppressed++;
+    return;
+  }
+  dnd.actions = actions;
+  wl_data_offer_set_actions(drag_offer, actions, actions);
+  dnd.requests++;
+}
+
+void dnd_accept() {
+  if (dnd.accepted) {
+    dnd.suppressed++;
+    return;
+  }
+  dnd.accepted = 1;
+  wl_data_offer_accept(drag_offer, drag_enter_serial, dnd.mime);
+  dnd.requests++;
+}
+
+void dnd_update(wl_fixed_t x, wl_fixed_t y) {
+  int zone = hitmap_lookup(&drop_zones, x >> 8, y >> 8);
+
+  dnd.evaluated++;
+  if (zone == dnd.zone) return; // same zone, same answer
+  dnd.zone = zone;
+
+  dnd_set_actions(zone_action[zone]);
+  dnd_accept();
+}
+
+// The latest motion, at the start of a frame (and before a drop)
+void dnd_flush() {
+  if (!dnd.pending || !drag_offer) return;
+  dnd.pending = 0;
+  dnd_update(dnd.x, dnd.y);
 }
 
 void data_device_data_offer(void *data, struct wl_data_device *dev, struct wl_data_offer *id) {
-  fprintf(stderr, "[data_device.data_offer] %p\n", id);
+  log_info("[data_device.data_offer] %p\n", id);
   // data_offer = id;
-  wl_data_offer_add_listener(id, &data_offer_listener, NULL);
+  wl_data_offer_add_listener(id, &data_offer_listener, mime_offer_create()); // see destroy_offer()
 }
 
 void data_device_enter(void *data, struct wl_data_device *dev, uint32_t serial, struct wl_surface *sfc, wl_fixed_t x, wl_fixed_t y, struct wl_data_offer *offer) {
-  fprintf(stderr, "[data_device.enter]\n");
+  log_info("[data_device.enter]\n");
 
   drag_offer = offer;
   drag_enter_serial = serial;
-  saved_actions = dnd_action_at(x, y);
-  wl_data_offer_set_actions(offer, saved_actions, saved_actions);
-  wl_data_offer_accept(drag_offer, drag_enter_serial, "text/plain;charset=utf-8");
+
+  // the offer's types are all known by now and don't change
+  memset(&dnd, 0, sizeof(dnd));
+  dnd.zone = -1;
+  dnd.actions = ~0u;
+  dnd.mime = text_type(offer);
+  dnd_update(x, y); // the source waits for an answer to the enter right away
 }
 
 void data_device_leave(void *data, struct wl_data_device *dev) {
-  fprintf(stderr, "[data_device.leave]\n");
-  if (drag_offer) wl_data_offer_destroy(drag_offer); 
+  log_info("[data_device.leave]\n");
+  log_info("[dnd] %u motions, %u looked at, %u requests sent, %u suppressed\n", dnd.motions, dnd.evaluated, dnd.requests, dnd.suppressed);
+  destroy_offer(drag_offer);
+  drag_offer = NULL;
+  dnd.pending = 0;
 }
 
 void data_device_motion(void *data, struct wl_data_device *dev, uint32_t time, wl_fixed_t x, wl_fixed_t y) {
-  if (saved_actions != dnd_action_at(x, y)) {
-    saved_actions = dnd_action_at(x, y);
-    wl_data_offer_set_actions(drag_offer, saved_actions, saved_actions);
-    wl_data_offer_accept(drag_offer, drag_enter_serial, "text/plain;charset=utf-8");
-  }
+  dnd.motions++;
+  dnd.pending = 1;
+  dnd.x = x;
+  dnd.y = y;
 }
 
 void data_device_drop(void *data, struct wl_data_device *dev) {
+  dnd_flush();
+
   // if the action is "ask", force the "copy" action ;)
   if (drag_action == WL_DATA_DEVICE_MANAGER_DND_ACTION_ASK) {
-    wl_data_offer_set_actions(drag_offer, WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY, WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY);
-    wl_data_offer_accept(drag_offer, drag_enter_serial, "text/plain;charset=utf-8");
+    dnd_set_actions(WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY);
+    dnd_accept();
     return; // shall we call wl_data_offer_finish() here even though we actually didn't complete a DND?
   }
 
-  int fd[2], nfd;
-  struct epoll_event ev;
+  struct transfer *t;
   
-  if (!drag_offer) return;
-  if (pipe2(fd, __O_CLOEXEC) == -1) return;
+  if (!drag_offer || !dnd.mime) return;
 
-  ev.events = EPOLLIN;
-  ev.data.fd = drag_fd = fd[0];
-  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd[0], &ev) == -1) {
-    perror("Could not add fd[0]");
-    exit(1);
+  t = transfers_receive(transfers, drag_offer, dnd.mime, drop_received, NULL);
+  if (!t) {
+    log_warn("Could not start the transfer\n");
+    return;
   }
+  t->offer = NULL; // the leave that follows the drop destroys the offer: don't cancel with it
 
-  wl_data_offer_receive(drag_offer, "text/plain;charset=utf-8", fd[1]);
-  // wl_display_flush(display);
-  close(fd[1]);
-
-  fprintf(stderr, "[data_device.drop] wait for the source client to send the data...\n");
+  log_info("[data_device.drop] wait for the source client to send the data...\n");
 
   wl_data_offer_finish(drag_offer);
 }
 
 void data_device_selection(void *data, struct wl_data_device *dev, struct wl_data_offer *id) {
-  fprintf(stderr, "[data_device.selection] id(new) = %p, data_offer(old) = %p\n", id, data_offer);
-  if (data_offer) wl_data_offer_destroy(data_offer);
+  log_info("[data_device.selection] id(new) = %p, data_offer(old) = %p\n", id, data_offer);
+  destroy_offer(data_offer);
   data_offer = id; // data_offer can be NULL
+
+  payload_unref(pasted);
+  pasted = NULL;
 }
 
 struct wl_data_device_listener data_device_listener = {
@@ -520,9 +746,10 @@ struct wl_data_device_listener data_device_listener = {
 };
 
 void global_add(void *data, struct wl_registry *registry, uint32_t id, const char *interface, uint32_t version) {
-  printf("Added: %s, %d\n", interface, id);
+  log_debug("Added: %s, %d\n", interface, id);
   if (strcmp(interface, "wl_compositor") == 0) {
-    compositor = wl_registry_bind(registry, id, &wl_compositor_interface, 1);
+    compositor_version = version < 4 ? version : 4; // 4 for wl_surface.damage_buffer
+    compositor = wl_registry_bind(registry, id, &wl_compositor_interface, compositor_version);
   }
 
   if (strcmp(interface, "wl_shell") == 0) {
@@ -550,7 +777,7 @@ void global_add(void *data, struct wl_registry *registry, uint32_t id, const cha
 }
 
 void global_remove(void *data, struct wl_registry *registry, uint32_t id) {
-  printf("Removed: %d\n", id);
+  log_debug("Removed: %d\n", id);
 }
 
 struct wl_registry_listener registry_listener = {
@@ -575,35 +802,29 @@ struct wl_shell_surface_listener shell_surface_listener = {
   handle_popup_done
 };
 
-int epoll_read(int fd, char *buf, size_t *sz) {
-  int len = read(fd, buf + strlen(buf), 1024 - 1); // -1 is for '\0' we append later
-
-  if (len == 0) { // No more data to paste
-    close(fd);
-    // We don't have to delete clipboard_fd from epfd manually (see `man epoll`, Q6/A6)
-    // if (epoll_ctl(epfd, EPOLL_CTL_DEL, clipboard_fd, &ev) == -1) {
-    //   perror("could not delete fd[0]\n");
-    //   exit(1);
-    // }
-
-    fd = -1;
-    buf[strlen(buf)] = '\0'; // append '\0'
-    fprintf(stderr, "received: %s\n", buf);
-
-    // reset clipboard
-    strcpy(buf, "");
-    return 1;
-  }
+// Event loop sources
+void raster_ready(void *data, int fd, uint32_t events) {
+  if (raster_finish(raster)) commit_frame();
+}
 
-  if (strlen(buf) + 1024 > *sz) {
-    *sz += 1024;
-    buf = (char *)realloc(buf, *sz);
-  }
+void stats_signal(void *data, int fd, uint32_t events) {
+  if (stats_handle_signal(stats) < 0) event_loop_quit(loop);
+}
 
-  return 0;
+void dispatch_observer(void *data, int phase) {
+  if (phase == EVENT_LOOP_DISPATCH_BEGIN) stats_dispatch_begin(stats);
+  else stats_dispatch_end(stats);
 }
 
 int main(int argc, char **argv) {
+  // before any thread gets started, see stats_create()
+  stats = stats_create("clipboard");
+  if (stats == NULL) {
+    perror("Could not set up the frame statistics\n");
+    exit(1);
+  }
+  if (log_init() < 0) perror("Could not start the log thread, logging synchronously\n");
+
   display = wl_display_connect(NULL);
   if (display == NULL) {
     perror("Can't connect to the display\n");
@@ -611,6 +832,31 @@ int main(int argc, char **argv) {
   }
   printf("connected to the display\n");
 
+  // before the seat shows up: repeat_info may come with the first roundtrip
+  loop = event_loop_create(display);
+  key_repeat = loop ? key_repeat_create(loop, key_repeated, NULL) : NULL;
+  if (key_repeat == NULL) {
+    perror("Could not create the event loop\n");
+    exit(1);
+  }
+  keymap_cache = keymap_cache_create();
+  if (keymap_cache == NULL) {
+    perror("Could not create the xkb context\n");
+    exit(1);
+  }
+  char *timeout = getenv("CLIPBOARD_TIMEOUT_MS"); // for a source to send anything
+  transfers = transfers_create(loop, timeout ? atoi(timeout) : 0, RECEIVE_DEFAULT_SPILL);
+  if (transfers == NULL) {
+    perror("Could not create the transfer manager\n");
+    exit(1);
+  }
+  sender = sender_create(loop);
+  if (sender == NULL) {
+    perror("Could not create the sender\n");
+    exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN); // a receiver closing its pipe early is not our death (see sender.h)
+
   struct wl_registry *registry = wl_display_get_registry(display);
   wl_registry_add_listener(registry, &registry_listener, NULL);
   
@@ -631,9 +877,9 @@ int main(int argc, char **argv) {
     printf("Found shell!\n");
   }
 
+  // e.g. weston's headless backend: still draw (and benchmark), no input
   if (seat == NULL) {
-    perror("Could not find any seat\n");
-    exit(1);
+    log_warn("Could not find any seat, running without input\n");
   } else {
     printf("Found seat\n");
   }
@@ -659,68 +905,44 @@ int main(int argc, char **argv) {
   frame_callback = wl_surface_frame(surface);
   wl_callback_add_listener(frame_callback, &frame_listener, NULL);
 
-  clipboard_size = 1024;
-  clipboard = (char *)malloc(clipboard_size);
-
-  drag_content_size = 1024;
-  drag_content = (char *)malloc(drag_content_size);
+  char *budget = getenv("CLIPBOARD_HISTORY_BYTES");
+  history_init(&history, budget ? strtoul(budget, NULL, 0) : HISTORY_DEFAULT_BUDGET);
 
-  create_window();
-  redraw(NULL, NULL, 0);
+  raster = raster_create(0);
+  if (raster == NULL) {
+    perror("Could not start the raster threads\n");
+    exit(1);
+  }
 
-  // init epoll
-  epfd = epoll_create1(0);
-  if (epfd == -1) {
-    perror("Could not create epoll instance\n");
+  if (!event_loop_add_fd(loop, raster_get_fd(raster), EPOLLIN, raster_ready, NULL) ||
+      !event_loop_add_fd(loop, stats_get_fd(stats), EPOLLIN, stats_signal, NULL)) {
+    perror("Could not create the event loop\n");
     exit(1);
   }
+  event_loop_set_observer(loop, dispatch_observer, NULL);
 
-  struct epoll_event disp_ev, clipboard_ev;
-  struct epoll_event events[16];
-  disp_ev.events = POLLIN;
-  disp_ev.data.fd = wl_display_get_fd(display);
-  clipboard_ev.events = POLLIN;
-  clipboard_ev.data.fd = clipboard_fd = -1;
-  epoll_ctl(epfd, EPOLL_CTL_ADD, wl_display_get_fd(display), &disp_ev);
-  epoll_ctl(epfd, EPOLL_CTL_ADD, clipboard_fd, &clipboard_ev);
-
-  // dispatch & event loop
-  int x;
-  while (1) {
-    wl_display_flush(display);
-
-    int nfd = epoll_wait(epfd, events, 16, -1);
-    if (nfd == -1) {
-      perror("epoll_wait error");
-      exit(1);
-    }
+  create_window();
+  layout_drop_zones();
+  redraw(NULL, NULL, 0);
 
-    for (int i = 0; i < nfd; i++) {
-      if (events[i].data.fd == wl_display_get_fd(display)) {
-        x = wl_display_dispatch(display);
-        if (x == -1) break;
-      }
-
-      if (events[i].data.fd == clipboard_fd) {
-        fprintf(stderr, "[polling] transferring clipboard data...\n");
-        if (epoll_read(clipboard_fd, clipboard, &clipboard_size) == 1) break;
-      }
-
-      if (events[i].data.fd == drag_fd) {
-        fprintf(stderr, "[polling] transferring dnd data...\n");
-        if (epoll_read(drag_fd, drag_content, &drag_content_size) == 1) break;
-      }
-    }
-  }
+  event_loop_run(loop);
 
   // cleanup
-  wl_seat_release(seat);
-  wl_data_offer_destroy(data_offer);
-  wl_data_device_destroy(data_device);
-  wl_data_device_manager_destroy(data_device_man);
-  free(clipboard);
-  free(drag_content);
-
+  if (seat) wl_seat_release(seat);
+  destroy_offer(data_offer);
+  if (data_device) wl_data_device_destroy(data_device);
+  if (data_device_man) wl_data_device_manager_destroy(data_device_man);
+  transfers_destroy(transfers);
+  payload_unref(pasted);
+  history_fini(&history);
+  sender_destroy(sender);
+
+  key_repeat_destroy(key_repeat);
+  keymap_cache_destroy(keymap_cache);
+  event_loop_destroy(loop);
+  raster_destroy(raster);
+  hitmap_fini(&drop_zones);
+  stats_destroy(stats);
   wl_display_disconnect(display);
   printf("disconnected from the display\n");
 
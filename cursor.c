@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <wayland-client.h>
+#include <wayland-cursor.h>
+
+#include "cursor.h"
+
+struct cursor_cache *cursor_cache_create(struct wl_compositor *compositor, struct wl_shm *shm,
+    int size, const char *const *names, int n) {
+  struct cursor_cache *c;
+  struct wl_cursor *fallback;
+  int i, j;
+
+  if (n > CURSOR_CACHE_MAX) return NULL;
+
+  c = calloc(1, sizeof(*c));
+  if (!c) return NULL;
+  c->current = -1;
+  c->ncursors = n;
+
+  c->theme = wl_cursor_theme_load(NULL, size, shm);
+  if (!c->theme) goto fail;
+
+  fallback = wl_cursor_theme_get_cursor(c->theme, CURSOR_DEFAULT);
+  for (i = 0; i < n; i++) {
+    c->cursors[i] = names[i] ? wl_cursor_theme_get_cursor(c->theme, names[i]) : NULL;
+    if (!c->cursors[i]) c->cursors[i] = fallback;
+    if (!c->cursors[i]) {
+      fprintf(stderr, "The cursor theme has neither %s nor %s\n", names[i] ? names[i] : "(none)", CURSOR_DEFAULT);
+      goto fail;
+    }
+    for (j = 0; j < (int)c->cursors[i]->image_count; j++) {
+      if (!wl_cursor_image_get_buffer(c->cursors[i]->images[j])) goto fail;
+    }
+  }
+
+  c->surface = wl_compositor_create_surface(compositor);
+  if (!c->surface) goto fail;
+
+  return c;
+
+fail:
+  if (c->theme) wl_cursor_theme_destroy(c->theme);
+  free(c);
+  return NULL;
+}
+
+void cursor_cache_destroy(struct cursor_cache *c) {
+  if (!c) return;
+
+  if (c->frame) wl_callback_destroy(c->frame);
+  wl_surface_destroy(c->surface);
+  wl_cursor_theme_destroy(c->theme);
+  free(c);
+}
+
+static void cursor_frame_done(void *data, struct wl_callback *callback, uint32_t time);
+
+static const struct wl_callback_listener cursor_frame_listener = {
+  cursor_frame_done
+};
+
+static void stop_animation(struct cursor_cache *c) {
+  if (c->frame) wl_callback_destroy(c->frame);
+  c->frame = NULL;
+}
+
+// Attach image i of the current cursor. The attach offset moves the
+// surface so that the new hotspot lands where the old one was.
+static void show_image(struct cursor_cache *c, int i, int dx, int dy) {
+  struct wl_cursor *cursor = c->cursors[c->current];
+  struct wl_cursor_image *image = cursor->images[i];
+
+  c->image = i;
+  wl_surface_attach(c->surface, wl_cursor_image_get_buffer(image), dx, dy);
+  wl_surface_damage(c->surface, 0, 0, image->width, image->height);
+  if (cursor->image_count > 1 && !c->frame) {
+    c->frame = wl_surface_frame(c->surface);
+    wl_callback_add_listener(c->frame, &cursor_frame_listener, c);
+  }
+  wl_surface_commit(c->surface);
+}
+
+static void cursor_frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+  struct cursor_cache *c = data;
+  struct wl_cursor *cursor;
+  struct wl_cursor_image *from, *to;
+  uint32_t duration;
+  int i;
+
+  wl_callback_destroy(callback);
+  c->frame = NULL;
+  if (!c->pointer || c->current < 0) return;
+
+  cursor = c->cursors[c->current];
+  if (!c->anim_started) {
+    c->anim_start = time;
+    c->anim_started = 1;
+  }
+  i = wl_cursor_frame_and_duration(cursor, time - c->anim_start, &duration);
+
+  if (i == c->image) {
+    // Nothing to show yet: only ask to be woken up on the next frame.
+    c->frame = wl_surface_frame(c->surface);
+    wl_callback_add_listener(c->frame, &cursor_frame_listener, c);
+    wl_surface_commit(c->surface);
+    return;
+  }
+
+  from = cursor->images[c->image];
+  to = cursor->images[i];
+  show_image(c, i, (int)from->hotspot_x - (int)to->hotspot_x, (int)from->hotspot_y - (int)to->hotspot_y);
+}
+
+void cursor_cache_enter(struct cursor_cache *c, struct wl_pointer *pointer, uint32_t serial) {
+  c->pointer = pointer;
+  c->serial = serial;
+  c->current = -1;
+}
+
+void cursor_cache_leave(struct cursor_cache *c) {
+  c->pointer = NULL;
+  stop_animation(c);
+}
+
+void cursor_cache_set(struct cursor_cache *c, int index) {
+  struct wl_cursor_image *image;
+
+  if (!c->pointer || index < 0 || index >= c->ncursors) return;
+  // Several indices may share a cursor (the fallback): nothing to do then
+  // either.
+  if (c->current >= 0 && c->cursors[c->current] == c->cursors[index]) {
+    c->current = index;
+    return;
+  }
+  c->current = index;
+
+  // the buffers all exist already, see cursor_cache_create()
+  stop_animation(c);
+  c->anim_started = 0;
+  image = c->cursors[index]->images[0];
+  show_image(c, 0, 0, 0);
+  wl_pointer_set_cursor(c->pointer, c->serial, c->surface, image->hotspot_x, image->hotspot_y);
+}
@@ -0,0 +1,48 @@
+#ifndef CURSOR_H
+#define CURSOR_H
+
+#include <stdint.h>
+#include <wayland-client.h>
+#include <wayland-cursor.h>
+
+// One cursor surface for the lifetime of the pointer, and a table of the
+// cursors we switch between, looked up in the theme once up front. Motion
+// events only cost a table lookup: the surface is re-attached and
+// wl_pointer.set_cursor sent only when the cursor actually changes, or
+// when the pointer enters again (the compositor forgets ours on leave).
+//
+// Animated cursors are played back from the cursor surface's frame
+// callbacks, so the compositor sets the pace and nothing runs while the
+// cursor isn't shown or isn't animated. The buffers for every image are
+// created when the cache is, not in the middle of an animation.
+#define CURSOR_CACHE_MAX 16
+#define CURSOR_DEFAULT "left_ptr"
+
+struct cursor_cache {
+  struct wl_cursor_theme *theme;
+  struct wl_surface *surface;
+  struct wl_pointer *pointer;
+  uint32_t serial; // of the last wl_pointer.enter
+
+  struct wl_cursor *cursors[CURSOR_CACHE_MAX];
+  int ncursors;
+  int current; // index into cursors, -1: not set since the last enter
+
+  // playback of cursors[current]
+  int image;
+  struct wl_callback *frame;
+  uint32_t anim_start;
+  int anim_started;
+};
+
+// names[i] is the cursor for index i; missing names (or NULL) fall back to
+// CURSOR_DEFAULT.
+struct cursor_cache *cursor_cache_create(struct wl_compositor *compositor, struct wl_shm *shm,
+    int size, const char *const *names, int n);
+void cursor_cache_destroy(struct cursor_cache *c);
+
+void cursor_cache_enter(struct cursor_cache *c, struct wl_pointer *pointer, uint32_t serial);
+void cursor_cache_leave(struct cursor_cache *c);
+void cursor_cache_set(struct cursor_cache *c, int index);
+
+#endif
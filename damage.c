@@ -0,0 +1,91 @@
+#include <wayland-client.h>
+#include <wayland-client-protocol.h>
+
+#include "damage.h"
+
+void damage_fini(struct damage *d) {
+  region_fini(&d->region);
+}
+
+void damage_clear(struct damage *d) {
+  region_clear(&d->region);
+}
+
+int damage_empty(const struct damage *d) {
+  return region_empty(&d->region);
+}
+
+const struct box *damage_boxes(const struct damage *d, int *n) {
+  return region_boxes(&d->region, n);
+}
+
+// Out of memory: repainting the bounding box is never wrong, only coarser.
+static void add_extents(struct damage *d, const struct box *b) {
+  struct box *e = &d->region.extents;
+
+  if (d->region.n == 0) {
+    *e = *b;
+  } else {
+    if (b->x1 < e->x1) e->x1 = b->x1;
+    if (b->y1 < e->y1) e->y1 = b->y1;
+    if (b->x2 > e->x2) e->x2 = b->x2;
+    if (b->y2 > e->y2) e->y2 = b->y2;
+  }
+  d->region.n = 1;
+}
+
+void damage_add(struct damage *d, int x, int y, int width, int height) {
+  if (width <= 0 || height <= 0) return;
+
+  if (region_union_rect(&d->region, &d->region, x, y, width, height) < 0) {
+    add_extents(d, &(struct box){ x, y, x + width, y + height });
+    return;
+  }
+  region_simplify(&d->region, DAMAGE_MAX_RECTS);
+}
+
+void damage_add_damage(struct damage *d, const struct damage *other) {
+  if (region_union(&d->region, &d->region, &other->region) < 0) {
+    add_extents(d, &other->region.extents);
+    return;
+  }
+  region_simplify(&d->region, DAMAGE_MAX_RECTS);
+}
+
+void damage_send(const struct damage *d, struct wl_surface *surface, uint32_t compositor_version) {
+  const struct box *b;
+  int i, n;
+
+  b = damage_boxes(d, &n);
+  for (i = 0; i < n; i++) {
+    if (compositor_version >= 4) {
+      wl_surface_damage_buffer(surface, b[i].x1, b[i].y1, b[i].x2 - b[i].x1, b[i].y2 - b[i].y1);
+    } else {
+      wl_surface_damage(surface, b[i].x1, b[i].y1, b[i].x2 - b[i].x1, b[i].y2 - b[i].y1);
+    }
+  }
+}
+
+void damage_ring_fini(struct damage_ring *r) {
+  int i;
+
+  for (i = 0; i < DAMAGE_RING_SIZE; i++) damage_fini(&r->frames[i]);
+}
+
+void damage_ring_push(struct damage_ring *r, const struct damage *frame) {
+  r->head = (r->head + 1) % DAMAGE_RING_SIZE;
+  damage_clear(&r->frames[r->head]);
+  damage_add_damage(&r->frames[r->head], frame);
+  if (r->count < DAMAGE_RING_SIZE) r->count++;
+}
+
+int damage_ring_get(const struct damage_ring *r, int age, struct damage *d) {
+  int i;
+
+  if (age <= 0 || age - 1 > r->count) return -1;
+
+  for (i = 0; i < age - 1; i++) {
+    damage_add_damage(d, &r->frames[(r->head - i + DAMAGE_RING_SIZE) % DAMAGE_RING_SIZE]);
+  }
+  return 0;
+}
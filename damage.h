@@ -0,0 +1,45 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include <wayland-client.h>
+
+#include "region.h"
+
+// Damage is a region whose rectangles get merged as they come in. Past
+// this many boxes it is replaced by its bounding box: a few extra pixels
+// are cheaper than flooding the socket with tiny damage requests.
+#define DAMAGE_MAX_RECTS 16
+
+struct damage {
+  struct region region;
+};
+
+void damage_fini(struct damage *d);
+void damage_clear(struct damage *d);
+void damage_add(struct damage *d, int x, int y, int width, int height);
+void damage_add_damage(struct damage *d, const struct damage *other);
+int damage_empty(const struct damage *d);
+const struct box *damage_boxes(const struct damage *d, int *n);
+// wl_surface.damage_buffer needs wl_compositor version 4; older ones get
+// wl_surface.damage, which is the same thing as long as we don't scale.
+void damage_send(const struct damage *d, struct wl_surface *surface, uint32_t compositor_version);
+
+// The damage of the last few frames, for buffers that come back with their
+// old contents (EGL_EXT_buffer_age): a buffer last drawn `age` frames ago
+// only misses what changed in the age - 1 frames since. Anything older than
+// the ring has to be repainted in full.
+#define DAMAGE_RING_SIZE 4
+
+struct damage_ring {
+  struct damage frames[DAMAGE_RING_SIZE];
+  int head; // the latest frame
+  int count;
+};
+
+void damage_ring_fini(struct damage_ring *r);
+void damage_ring_push(struct damage_ring *r, const struct damage *frame);
+// Adds to `d` what a buffer of that age is missing. -1: its contents are
+// unknown (age 0) or too old.
+int damage_ring_get(const struct damage_ring *r, int age, struct damage *d);
+
+#endif
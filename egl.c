@@ -1,4 +1,4 @@
-// $ gcc -lEGL -lGLESv2 -lwayland-client -lwayland-egl egl.c
+// $ gcc -lEGL -lGLESv2 -lwayland-client -lwayland-egl egl.c damage.c region.c event_loop.c
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,8 +8,13 @@
 #include <wayland-client-protocol.h>
 #include <wayland-egl.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <GLES2/gl2.h>
 
+#include "region.h"
+#include "damage.h"
+#include "event_loop.h"
+
 #define WIDTH 500
 #define HEIGHT 400
 
@@ -25,6 +30,10 @@ EGLConfig egl_conf;
 EGLSurface egl_surface;
 EGLContext egl_context;
 
+// Optional extensions, see init_egl_extensions()
+int has_buffer_age;
+PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC swap_buffers_with_damage;
+
 void *shm_data;
 
 void init_egl() {
@@ -76,6 +85,32 @@ void init_egl() {
   egl_context = eglCreateContext(egl_display, egl_conf, EGL_NO_CONTEXT, context_attribs);
 }
 
+int has_extension(const char *extensions, const char *name) {
+  size_t len = strlen(name);
+  const char *p = extensions;
+
+  while (p && (p = strstr(p, name))) {
+    if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) return 1;
+    p += len;
+  }
+  return 0;
+}
+
+// Without buffer age every frame is painted in full; without swap with
+// damage the compositor is told the whole surface changed. Both still work.
+void init_egl_extensions() {
+  const char *extensions = eglQueryString(egl_display, EGL_EXTENSIONS);
+
+  has_buffer_age = has_extension(extensions, "EGL_EXT_buffer_age");
+  // the EXT and KHR versions have the same signature
+  if (has_extension(extensions, "EGL_KHR_swap_buffers_with_damage")) {
+    swap_buffers_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC) eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+  } else if (has_extension(extensions, "EGL_EXT_swap_buffers_with_damage")) {
+    swap_buffers_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC) eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+  }
+  printf("EGL buffer age: %s, swap with damage: %s\n", has_buffer_age ? "yes" : "no", swap_buffers_with_damage ? "yes" : "no");
+}
+
 int pixel_value = 0x0;
 
 void paint_pixels() {
@@ -93,6 +128,113 @@ void paint_pixels() {
 }
 
 static const struct wl_callback_listener frame_listener;
+struct wl_callback *frame_callback;
+
+// Same scene as surface_part_damage.c: the rows above `ht` take the new
+// color every frame, the ones below keep whatever they had last.
+uint32_t row_color[HEIGHT];
+uint32_t ht;
+struct damage frame_damage; // what changed since the previous frame
+struct damage_ring history;
+struct damage repaint; // what the current back buffer is missing
+
+void update_scene() {
+  int y;
+
+  if (ht == 0) ht = HEIGHT;
+  for (y = 0; y < ht; y++) row_color[y] = pixel_value;
+  damage_add(&frame_damage, 0, 0, WIDTH, ht);
+  ht--;
+
+  pixel_value += 0x010101;
+  if (pixel_value > 0xffffff) {
+    pixel_value = 0x0;
+  }
+}
+
+// How many frames ago the back buffer was drawn; 0 if we can't know
+int buffer_age() {
+  EGLint age = 0;
+
+  if (!has_buffer_age) return 0;
+  if (!eglQuerySurface(egl_display, egl_surface, EGL_BUFFER_AGE_EXT, &age)) return 0;
+  return age;
+}
+
+// GL's y axis goes up: y2 is the bottom edge of a box in GL terms
+void paint_box(const struct box *b) {
+  uint32_t c;
+  int y, y0;
+
+  // one scissored clear per run of rows of the same color
+  for (y = b->y1; y < b->y2; y = y0) {
+    c = row_color[y];
+    for (y0 = y + 1; y0 < b->y2 && row_color[y0] == c; y0++);
+
+    glScissor(b->x1, HEIGHT - y0, b->x2 - b->x1, y0 - y);
+    glClearColor(((c >> 16) & 0xff) / 255.0, ((c >> 8) & 0xff) / 255.0, (c & 0xff) / 255.0, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+  }
+}
+
+void swap_buffers() {
+  EGLint rects[4 * DAMAGE_MAX_RECTS];
+  const struct box *b;
+  int i, n;
+
+  if (!swap_buffers_with_damage) {
+    eglSwapBuffers(egl_display, egl_surface);
+    return;
+  }
+
+  // damage_add() keeps it to DAMAGE_MAX_RECTS
+  b = damage_boxes(&frame_damage, &n);
+  for (i = 0; i < n; i++) {
+    rects[4 * i] = b[i].x1;
+    rects[4 * i + 1] = HEIGHT - b[i].y2;
+    rects[4 * i + 2] = b[i].x2 - b[i].x1;
+    rects[4 * i + 3] = b[i].y2 - b[i].y1;
+  }
+  swap_buffers_with_damage(egl_display, egl_surface, rects, n);
+}
+
+// Only paint what the back buffer has missed since it was last current,
+// and only tell the compositor about what changed since the last frame.
+void redraw() {
+  const struct box *b;
+  int i, n;
+
+  update_scene();
+
+  damage_clear(&repaint);
+  if (damage_ring_get(&history, buffer_age(), &repaint) < 0) {
+    damage_add(&repaint, 0, 0, WIDTH, HEIGHT);
+  } else {
+    damage_add_damage(&repaint, &frame_damage);
+  }
+  damage_ring_push(&history, &frame_damage);
+
+  glEnable(GL_SCISSOR_TEST);
+  b = damage_boxes(&repaint, &n);
+  for (i = 0; i < n; i++) paint_box(&b[i]);
+  glDisable(GL_SCISSOR_TEST);
+
+  // the swap commits the surface, and the frame callback with it
+  frame_callback = wl_surface_frame(surface);
+  wl_callback_add_listener(frame_callback, &frame_listener, NULL);
+  swap_buffers();
+  damage_clear(&frame_damage);
+}
+
+void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+  wl_callback_destroy(callback);
+  frame_callback = NULL;
+  redraw();
+}
+
+static const struct wl_callback_listener frame_listener = {
+  frame_done
+};
 
 void create_window() {
   egl_window = wl_egl_window_create(surface, WIDTH, HEIGHT);
@@ -110,21 +252,27 @@ void create_window() {
     fprintf(stderr, "Made current error\n");
   }
 
-  glClearColor(1.0, 1.0, 0.0, 0.4);
-  glClear(GL_COLOR_BUFFER_BIT);
-  glFlush();
+  // frame callbacks pace us, the swap must never block the event loop
+  eglSwapInterval(egl_display, 0);
+  init_egl_extensions();
 
-  if (eglSwapBuffers(egl_display, egl_surface)) {
-    fprintf(stderr, "Swapped buffers\n");
-  } else {
-    fprintf(stderr, "Swapping buffers error\n");
-  }
+  redraw();
 }
 
+struct region opaque;
+
 void create_opaque_region() {
   struct wl_region *region = wl_compositor_create_region(compositor);
-  wl_region_add(region, 0, 0, WIDTH, HEIGHT);
+  const struct box *b;
+  int i, n;
+
+  region_init_rect(&opaque, 0, 0, WIDTH, HEIGHT);
+  b = region_boxes(&opaque, &n);
+  for (i = 0; i < n; i++) {
+    wl_region_add(region, b[i].x1, b[i].y1, b[i].x2 - b[i].x1, b[i].y2 - b[i].y1);
+  }
   wl_surface_set_opaque_region(surface, region);
+  wl_region_destroy(region); // the surface keeps its own copy
 }
 
 void global_add(void *data, struct wl_registry *registry, uint32_t id, const char *interface, uint32_t version) {
@@ -197,9 +345,13 @@ int main(int argc, char **argv) {
   init_egl();
   create_window();
 
-  while (wl_display_dispatch(display) != -1) {
-    // do nothing
+  struct event_loop *loop = event_loop_create(display);
+  if (loop == NULL) {
+    perror("Could not create the event loop\n");
+    exit(1);
   }
+  event_loop_run(loop);
+  event_loop_destroy(loop);
 
   wl_display_disconnect(display);
   printf("disconnected from the display\n");
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <wayland-client.h>
+
+#include "event_loop.h"
+
+#define MAX_EVENTS 32
+#define NSEC_PER_SEC 1000000000ull
+
+enum source_type {
+  SOURCE_FD,
+  SOURCE_TIMER,
+  SOURCE_DISPLAY,
+  SOURCE_POST
+};
+
+struct event_source {
+  struct event_loop *loop;
+  enum source_type type;
+  int fd;
+  uint32_t events;
+  event_loop_fd_func fd_func;
+  event_loop_timer_func timer_func;
+  void *data;
+
+  int removed; // still in `sources` until the end of the round
+  struct event_source *next;
+};
+
+struct post {
+  event_loop_post_func func;
+  void *data;
+  struct post *next;
+};
+
+struct event_loop {
+  int epfd;
+  struct wl_display *display;
+  struct event_source *display_source;
+  struct event_source *post_source;
+  struct event_source *sources;
+  int quit;
+
+  event_loop_observer_func observer;
+  void *observer_data;
+
+  pthread_mutex_t post_lock;
+  struct post *posts, **posts_tail;
+};
+
+static struct event_source *add_source(struct event_loop *l, enum source_type type, int fd, uint32_t events, void *data) {
+  struct event_source *s = calloc(1, sizeof(*s));
+  struct epoll_event ev;
+
+  if (!s) return NULL;
+
+  s->loop = l;
+  s->type = type;
+  s->fd = fd;
+  s->events = events;
+  s->data = data;
+
+  ev.events = events;
+  ev.data.ptr = s;
+  if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    free(s);
+    return NULL;
+  }
+
+  s->next = l->sources;
+  l->sources = s;
+  return s;
+}
+
+static void free_removed(struct event_loop *l) {
+  struct event_source **p = &l->sources, *s;
+
+  while ((s = *p)) {
+    if (s->removed) {
+      *p = s->next;
+      free(s);
+    } else {
+      p = &s->next;
+    }
+  }
+}
+
+struct event_loop *event_loop_create(struct wl_display *display) {
+  struct event_loop *l = calloc(1, sizeof(*l));
+  int fd;
+
+  if (!l) return NULL;
+
+  l->display = display;
+  l->posts_tail = &l->posts;
+  pthread_mutex_init(&l->post_lock, NULL);
+
+  l->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (l->epfd < 0) goto fail;
+
+  if (display) {
+    l->display_source = add_source(l, SOURCE_DISPLAY, wl_display_get_fd(display), EPOLLIN, NULL);
+    if (!l->display_source) goto fail;
+  }
+
+  fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd < 0) goto fail;
+  l->post_source = add_source(l, SOURCE_POST, fd, EPOLLIN, NULL);
+  if (!l->post_source) {
+    close(fd);
+    goto fail;
+  }
+
+  return l;
+
+fail:
+  event_loop_destroy(l);
+  return NULL;
+}
+
+void event_loop_destroy(struct event_loop *l) {
+  struct event_source *s, *next;
+  struct post *p, *pnext;
+
+  if (!l) return;
+
+  for (s = l->sources; s; s = next) {
+    next = s->next;
+    if (!s->removed && (s->type == SOURCE_TIMER || s->type == SOURCE_POST)) close(s->fd);
+    free(s);
+  }
+  for (p = l->posts; p; p = pnext) {
+    pnext = p->next;
+    free(p);
+  }
+
+  if (l->epfd >= 0) close(l->epfd);
+  pthread_mutex_destroy(&l->post_lock);
+  free(l);
+}
+
+void event_loop_set_observer(struct event_loop *l, event_loop_observer_func func, void *data) {
+  l->observer = func;
+  l->observer_data = data;
+}
+
+struct event_source *event_loop_add_fd(struct event_loop *l, int fd, uint32_t events, event_loop_fd_func func, void *data) {
+  struct event_source *s = add_source(l, SOURCE_FD, fd, events, data);
+
+  if (s) s->fd_func = func;
+  return s;
+}
+
+int event_loop_update_fd(struct event_source *s, uint32_t events) {
+  struct epoll_event ev;
+
+  if (s->events == events) return 0;
+
+  ev.events = events;
+  ev.data.ptr = s;
+  if (epoll_ctl(s->loop->epfd, EPOLL_CTL_MOD, s->fd, &ev) < 0) return -1;
+  s->events = events;
+  return 0;
+}
+
+struct event_source *event_loop_add_timer(struct event_loop *l, clockid_t clock, event_loop_timer_func func, void *data) {
+  struct event_source *s;
+  int fd;
+
+  fd = timerfd_create(clock, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fd < 0) return NULL;
+
+  s = add_source(l, SOURCE_TIMER, fd, EPOLLIN, data);
+  if (!s) {
+    close(fd);
+    return NULL;
+  }
+  s->timer_func = func;
+  return s;
+}
+
+static void ns_to_timespec(uint64_t ns, struct timespec *ts) {
+  ts->tv_sec = ns / NSEC_PER_SEC;
+  ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+int event_loop_timer_arm(struct event_source *s, uint64_t value, uint64_t interval, int absolute) {
+  struct itimerspec its;
+
+  // a relative 0 would disarm it: fire as soon as possible instead
+  if (value == 0 && !absolute) value = 1;
+
+  ns_to_timespec(value, &its.it_value);
+  ns_to_timespec(interval, &its.it_interval);
+  return timerfd_settime(s->fd, absolute ? TFD_TIMER_ABSTIME : 0, &its, NULL);
+}
+
+int event_loop_timer_disarm(struct event_source *s) {
+  struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+  return timerfd_settime(s->fd, 0, &its, NULL);
+}
+
+void event_loop_remove(struct event_source *s) {
+  if (!s || s->removed) return;
+
+  epoll_ctl(s->loop->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+  if (s->type == SOURCE_TIMER) close(s->fd);
+  s->removed = 1; // freed once the current round is over
+}
+
+int event_source_get_fd(struct event_source *s) {
+  return s->fd;
+}
+
+int event_loop_post(struct event_loop *l, event_loop_post_func func, void *data) {
+  struct post *p = malloc(sizeof(*p));
+  uint64_t one = 1;
+
+  if (!p) return -1;
+  p->func = func;
+  p->data = data;
+  p->next = NULL;
+
+  pthread_mutex_lock(&l->post_lock);
+  *l->posts_tail = p;
+  l->posts_tail = &p->next;
+  pthread_mutex_unlock(&l->post_lock);
+
+  return write(l->post_source->fd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+static void run_posts(struct event_loop *l) {
+  struct post *p, *next;
+  uint64_t count;
+
+  if (read(l->post_source->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) return;
+
+  pthread_mutex_lock(&l->post_lock);
+  p = l->posts;
+  l->posts = NULL;
+  l->posts_tail = &l->posts;
+  pthread_mutex_unlock(&l->post_lock);
+
+  for (; p; p = next) {
+    next = p->next;
+    p->func(p->data);
+    free(p);
+  }
+}
+
+static void dispatch_source(struct event_source *s, uint32_t events) {
+  uint64_t expirations;
+
+  switch (s->type) {
+  case SOURCE_FD:
+    s->fd_func(s->data, s->fd, events);
+    break;
+  case SOURCE_TIMER:
+    if (read(s->fd, &expirations, sizeof(expirations)) == sizeof(expirations)) s->timer_func(s->data, expirations);
+    break;
+  case SOURCE_POST:
+    run_posts(s->loop);
+    break;
+  case SOURCE_DISPLAY:
+    break; // see event_loop_dispatch()
+  }
+}
+
+static int dispatch_display(struct event_loop *l) {
+  int ret;
+
+  if (l->observer) l->observer(l->observer_data, EVENT_LOOP_DISPATCH_BEGIN);
+  ret = wl_display_dispatch_pending(l->display);
+  if (l->observer) l->observer(l->observer_data, EVENT_LOOP_DISPATCH_END);
+
+  return ret < 0 ? -1 : 0;
+}
+
+int event_loop_dispatch(struct event_loop *l, int timeout_ms) {
+  struct epoll_event events[MAX_EVENTS];
+  uint32_t display_events = 0, want = EPOLLIN;
+  int n, i, ret = 0;
+
+  if (l->display) {
+    // nothing may be left in the queue while we sleep (see wl_display_prepare_read(3))
+    while (wl_display_prepare_read(l->display) != 0) {
+      if (dispatch_display(l) < 0) return -1;
+    }
+
+    // If the socket is full, the rest goes out once it drains
+    if (wl_display_flush(l->display) < 0) {
+      if (errno != EAGAIN) {
+        wl_display_cancel_read(l->display);
+        return -1;
+      }
+      want |= EPOLLOUT;
+    }
+    event_loop_update_fd(l->display_source, want);
+  }
+
+  n = epoll_wait(l->epfd, events, MAX_EVENTS, timeout_ms);
+  if (n < 0) {
+    if (l->display) wl_display_cancel_read(l->display);
+    return errno == EINTR ? 0 : -1;
+  }
+
+  // The display first: the read we prepared has to be completed or
+  // cancelled before anything else can touch the connection.
+  for (i = 0; i < n; i++) {
+    if (events[i].data.ptr == l->display_source) display_events = events[i].events;
+  }
+  if (l->display) {
+    if (display_events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+      if (wl_display_read_events(l->display) < 0) ret = -1;
+    } else {
+      wl_display_cancel_read(l->display);
+    }
+    if (ret == 0 && dispatch_display(l) < 0) ret = -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    struct event_source *s = events[i].data.ptr;
+
+    if (s->removed || s->type == SOURCE_DISPLAY) continue;
+    dispatch_source(s, events[i].events);
+  }
+
+  free_removed(l);
+  return ret;
+}
+
+int event_loop_run(struct event_loop *l) {
+  l->quit = 0;
+  while (!l->quit) {
+    if (event_loop_dispatch(l, -1) < 0) return -1;
+  }
+  return 0;
+}
+
+void event_loop_quit(struct event_loop *l) {
+  l->quit = 1;
+}
@@ -0,0 +1,57 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <wayland-client.h>
+
+// One epoll instance for everything a client waits on: the Wayland socket,
+// plain fds, timers (timerfd) and work posted from other threads (eventfd).
+// Every source gets a callback. The display is read the way
+// wl_display_prepare_read(3) asks for, so nothing is left sitting in the
+// queue while we sleep.
+//
+// Sources may be added and removed from inside callbacks, including the
+// one being dispatched.
+
+struct event_loop;
+struct event_source;
+
+typedef void (*event_loop_fd_func)(void *data, int fd, uint32_t events);
+typedef void (*event_loop_timer_func)(void *data, uint64_t expirations);
+typedef void (*event_loop_post_func)(void *data);
+
+// Called around the dispatching of Wayland events, for instrumentation.
+#define EVENT_LOOP_DISPATCH_BEGIN 0
+#define EVENT_LOOP_DISPATCH_END 1
+typedef void (*event_loop_observer_func)(void *data, int phase);
+
+struct event_loop *event_loop_create(struct wl_display *display); // display may be NULL
+void event_loop_destroy(struct event_loop *l);
+void event_loop_set_observer(struct event_loop *l, event_loop_observer_func func, void *data);
+
+struct event_source *event_loop_add_fd(struct event_loop *l, int fd, uint32_t events, event_loop_fd_func func, void *data);
+int event_loop_update_fd(struct event_source *s, uint32_t events);
+
+// A disarmed timer on `clock`; the loop owns the timerfd
+struct event_source *event_loop_add_timer(struct event_loop *l, clockid_t clock, event_loop_timer_func func, void *data);
+// In ns; absolute: `value` is a time on the timer's clock. interval 0: one-shot.
+int event_loop_timer_arm(struct event_source *s, uint64_t value, uint64_t interval, int absolute);
+int event_loop_timer_disarm(struct event_source *s);
+
+// Doesn't close a watched fd (but a timer's own timerfd)
+void event_loop_remove(struct event_source *s);
+int event_source_get_fd(struct event_source *s);
+
+// Runs func(data) on the loop's thread. Safe to call from any thread.
+int event_loop_post(struct event_loop *l, event_loop_post_func func, void *data);
+
+// One round: wait up to timeout_ms (-1: forever) and dispatch what came in.
+// Returns -1 when the display connection is gone.
+int event_loop_dispatch(struct event_loop *l, int timeout_ms);
+// Until event_loop_quit() or a display error (-1)
+int event_loop_run(struct event_loop *l);
+void event_loop_quit(struct event_loop *l);
+
+#endif
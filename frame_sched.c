@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <wayland-client.h>
+
+#include "presentation-time-client-protocol.h"
+#include "frame_sched.h"
+
+#define NSEC_PER_SEC 1000000000ull
+
+static uint64_t timespec_to_ns(const struct timespec *ts) {
+  return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+uint64_t frame_sched_now(struct frame_sched *s) {
+  struct timespec ts;
+
+  clock_gettime(s->clock, &ts);
+  return timespec_to_ns(&ts);
+}
+
+// Our timestamps have to be on the same clock as the ones we get. The
+// timer stays what it is: the fd may already be watched by an event loop,
+// and it is armed with a delay, which any clock measures the same.
+static void presentation_clock_id(void *data, struct wp_presentation *presentation, uint32_t clk_id) {
+  struct frame_sched *s = data;
+  struct timespec ts;
+
+  if (clock_gettime(clk_id, &ts) < 0) {
+    fprintf(stderr, "frame_sched: can't read clock %u, painting eagerly\n", clk_id);
+    s->presentation = NULL; // no feedback, no predictions
+    return;
+  }
+  s->clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+  presentation_clock_id
+};
+
+// What a wp_presentation_feedback carries back to us
+struct feedback {
+  struct frame_sched *sched;
+  unsigned seq; // number of the commit in the history
+};
+
+// NULL if the ring has wrapped around since that commit
+static struct frame_record *record(struct frame_sched *s, unsigned seq) {
+  if (s->nrecords - seq > FRAME_SCHED_HISTORY) return NULL;
+  return &s->history[seq % FRAME_SCHED_HISTORY];
+}
+
+static void feedback_sync_output(void *data, struct wp_presentation_feedback *feedback, struct wl_output *output) {
+}
+
+static void feedback_presented(void *data, struct wp_presentation_feedback *feedback,
+    uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+    uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+  struct feedback *fb = data;
+  struct frame_sched *s = fb->sched;
+  struct frame_record *rec = record(s, fb->seq);
+  uint64_t presented = (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * NSEC_PER_SEC + tv_nsec;
+  uint64_t msc = ((uint64_t)seq_hi << 32) | seq_lo;
+
+  if (rec) {
+    rec->presented_ns = presented;
+    rec->refresh_ns = refresh;
+  }
+
+  s->presented++;
+  // We commit every frame, so a gap in the vblank counter is a frame we
+  // were too late for. Outputs without a counter report 0.
+  if (msc && s->last_msc && msc > s->last_msc + 1) s->missed += msc - s->last_msc - 1;
+  if (msc > s->last_msc) s->last_msc = msc;
+  if (presented > s->last_presented_ns) {
+    s->last_presented_ns = presented;
+    s->refresh_ns = refresh;
+  }
+
+  wp_presentation_feedback_destroy(feedback);
+  free(fb);
+}
+
+static void feedback_discarded(void *data, struct wp_presentation_feedback *feedback) {
+  struct feedback *fb = data;
+
+  fb->sched->discarded++;
+  wp_presentation_feedback_destroy(feedback);
+  free(fb);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+  feedback_sync_output,
+  feedback_presented,
+  feedback_discarded
+};
+
+struct frame_sched *frame_sched_create(int margin_us) {
+  struct frame_sched *s = calloc(1, sizeof(*s));
+
+  if (!s) return NULL;
+
+  s->clock = CLOCK_MONOTONIC; // until wp_presentation tells us otherwise, see presentation_clock_id()
+  s->margin_ns = (uint64_t)(margin_us > 0 ? margin_us : FRAME_SCHED_DEFAULT_MARGIN_US) * 1000;
+  s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (s->timer_fd < 0) {
+    free(s);
+    return NULL;
+  }
+
+  return s;
+}
+
+// Call this right where wp_presentation gets bound: the clock_id event is
+// sent straight away and would be lost without a listener.
+void frame_sched_set_presentation(struct frame_sched *s, struct wp_presentation *presentation) {
+  s->presentation = presentation;
+  wp_presentation_add_listener(presentation, &presentation_listener, s);
+}
+
+void frame_sched_destroy(struct frame_sched *s) {
+  if (!s) return;
+
+  close(s->timer_fd);
+  free(s);
+}
+
+int frame_sched_get_fd(struct frame_sched *s) {
+  return s->timer_fd;
+}
+
+int frame_sched_schedule(struct frame_sched *s) {
+  struct itimerspec its;
+  uint64_t now, lead, vblank, start;
+
+  if (!s->presentation || !s->refresh_ns || !s->last_presented_ns) return 1;
+
+  now = frame_sched_now(s);
+  lead = s->margin_ns + s->paint_ns;
+
+  // the first predicted vblank we can still make
+  vblank = s->last_presented_ns + s->refresh_ns;
+  if (vblank < now + lead) {
+    vblank += (now + lead - vblank + s->refresh_ns - 1) / s->refresh_ns * s->refresh_ns;
+  }
+
+  start = vblank - lead;
+  if (start <= now) return 1;
+
+  // relative: the timer's clock need not be s->clock
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = (start - now) / NSEC_PER_SEC;
+  its.it_value.tv_nsec = (start - now) % NSEC_PER_SEC;
+  if (timerfd_settime(s->timer_fd, 0, &its, NULL) < 0) return 1;
+
+  return 0;
+}
+
+int frame_sched_ready(struct frame_sched *s) {
+  uint64_t expirations;
+
+  return read(s->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+}
+
+void frame_sched_begin(struct frame_sched *s) {
+  s->begin_ns = frame_sched_now(s);
+}
+
+void frame_sched_commit(struct frame_sched *s, struct wl_surface *surface) {
+  struct wp_presentation_feedback *feedback;
+  struct frame_record *rec;
+  struct feedback *fb;
+  uint64_t now = frame_sched_now(s), took;
+
+  if (s->begin_ns) {
+    // the estimate rises at once and decays slowly: missing a vblank costs
+    // far more than starting a bit early
+    took = now - s->begin_ns;
+    s->paint_ns = took > s->paint_ns ? took : (s->paint_ns * 7 + took) / 8;
+    s->begin_ns = 0;
+  }
+
+  rec = &s->history[s->nrecords % FRAME_SCHED_HISTORY];
+  memset(rec, 0, sizeof(*rec));
+  rec->commit_ns = now;
+
+  if (s->presentation && (fb = malloc(sizeof(*fb)))) {
+    fb->sched = s;
+    fb->seq = s->nrecords;
+    feedback = wp_presentation_feedback(s->presentation, surface);
+    wp_presentation_feedback_add_listener(feedback, &feedback_listener, fb);
+  }
+
+  s->nrecords++;
+}
@@ -0,0 +1,65 @@
+#ifndef FRAME_SCHED_H
+#define FRAME_SCHED_H
+
+#include <stdint.h>
+#include <time.h>
+#include <wayland-client.h>
+
+#include "presentation-time-client-protocol.h"
+
+// Paint as late as possible instead of right after the frame callback.
+//
+// Every commit asks for wp_presentation feedback, which tells us when the
+// frame actually hit the screen and the refresh interval of the output.
+// From there the next vblank can be predicted; we start painting at
+//   vblank - margin - (how long painting has been taking lately)
+// so the input we sample is as fresh as it can be when it is displayed.
+// The margin has to cover the compositor's own repaint window (weston
+// starts compositing 7ms before the vblank by default).
+//
+// Without wp_presentation (or before the first feedback) we paint right
+// away, which is what a plain frame callback loop does.
+
+#define FRAME_SCHED_DEFAULT_MARGIN_US 7000
+#define FRAME_SCHED_HISTORY 64
+
+struct frame_record {
+  uint64_t commit_ns;
+  uint64_t presented_ns; // 0 if discarded
+  uint32_t refresh_ns;
+};
+
+struct frame_sched {
+  struct wp_presentation *presentation;
+  clockid_t clock;         // of every timestamp, the compositor's
+  int timer_fd;            // CLOCK_MONOTONIC, never replaced
+
+  uint64_t margin_ns;
+  uint64_t paint_ns;       // moving average of begin() -> commit()
+  uint64_t begin_ns;
+  uint64_t last_presented_ns;
+  uint32_t refresh_ns;     // 0: unknown
+
+  struct frame_record history[FRAME_SCHED_HISTORY];
+  unsigned nrecords;       // total, the ring holds the last FRAME_SCHED_HISTORY
+  unsigned presented, discarded;
+  unsigned missed;         // refreshes that went by without a new frame
+  uint64_t last_msc;
+};
+
+struct frame_sched *frame_sched_create(int margin_us); // <= 0: the default margin
+void frame_sched_set_presentation(struct frame_sched *s, struct wp_presentation *presentation);
+void frame_sched_destroy(struct frame_sched *s);
+int frame_sched_get_fd(struct frame_sched *s);
+uint64_t frame_sched_now(struct frame_sched *s);
+
+// The frame callback came in. Returns 1 if painting should start right away,
+// otherwise the fd becomes readable when it is time (see frame_sched_ready()).
+int frame_sched_schedule(struct frame_sched *s);
+int frame_sched_ready(struct frame_sched *s);
+
+void frame_sched_begin(struct frame_sched *s);
+// Call right before wl_surface_commit().
+void frame_sched_commit(struct frame_sched *s, struct wl_surface *surface);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+
+// FNV-1a
+static uint64_t hash(const char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+void history_init(struct history *h, size_t budget) {
+  memset(h, 0, sizeof(*h));
+  h->budget = budget;
+}
+
+static void unlink_entry(struct history *h, struct history_entry *e) {
+  if (e->prev) e->prev->next = e->next;
+  else h->first = e->next;
+  if (e->next) e->next->prev = e->prev;
+  else h->last = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void push_front(struct history *h, struct history_entry *e) {
+  e->prev = NULL;
+  e->next = h->first;
+  if (h->first) h->first->prev = e;
+  else h->last = e;
+  h->first = e;
+}
+
+static void drop(struct history *h, struct history_entry *e) {
+  unlink_entry(h, e);
+  h->bytes -= e->payload->len;
+  h->count--;
+  payload_unref(e->payload);
+  free(e);
+}
+
+void history_fini(struct history *h) {
+  while (h->first) drop(h, h->first);
+}
+
+struct payload *history_add(struct history *h, const char *data, size_t len) {
+  uint64_t hsh = hash(data, len);
+  struct history_entry *e;
+
+  for (e = h->first; e; e = e->next) {
+    if (e->hash == hsh && e->payload->len == len && (len == 0 || memcmp(e->payload->data, data, len) == 0)) {
+      unlink_entry(h, e);
+      push_front(h, e);
+      h->deduplicated++;
+      return e->payload;
+    }
+  }
+
+  if (len > h->budget) return NULL;
+
+  e = calloc(1, sizeof(*e));
+  if (!e) return NULL;
+  e->payload = payload_create(data, len);
+  if (!e->payload) {
+    free(e);
+    return NULL;
+  }
+  e->hash = hsh;
+
+  push_front(h, e);
+  h->bytes += len;
+  h->count++;
+
+  // least recently seen first
+  while (h->bytes > h->budget || h->count > HISTORY_MAX_ENTRIES) drop(h, h->last);
+  return e->payload;
+}
+
+struct payload *history_get(struct history *h, int index) {
+  struct history_entry *e;
+
+  for (e = h->first; e && index > 0; e = e->next) index--;
+  return e ? e->payload : NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sender.h"
+
+// The selections we have seen, most recent first. Each is kept once: a
+// payload identical to one already in there (same hash, same bytes) just
+// moves that entry back to the front. Old entries go when the total goes
+// over the byte budget, or past HISTORY_MAX_ENTRIES.
+#define HISTORY_DEFAULT_BUDGET (16 << 20)
+#define HISTORY_MAX_ENTRIES 64
+
+struct history_entry {
+  uint64_t hash;
+  struct payload *payload;
+  struct history_entry *prev, *next;
+};
+
+struct history {
+  size_t budget, bytes;
+  int count;
+  struct history_entry *first, *last;
+  int deduplicated; // adds that found their payload in there already
+};
+
+void history_init(struct history *h, size_t budget);
+void history_fini(struct history *h);
+// Returns the entry's payload (no reference taken), NULL if it doesn't fit
+struct payload *history_add(struct history *h, const char *data, size_t len);
+// 0 is the latest; NULL past the end
+struct payload *history_get(struct history *h, int index);
+
+#endif
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hitmap.h"
+
+void hitmap_init(struct hitmap *m, int default_id) {
+  memset(m, 0, sizeof(*m));
+  m->default_id = default_id;
+}
+
+void hitmap_fini(struct hitmap *m) {
+  free(m->rects);
+  free(m->cells);
+  free(m->candidates);
+  hitmap_init(m, m->default_id);
+}
+
+void hitmap_reset(struct hitmap *m, int width, int height) {
+  m->width = width;
+  m->height = height;
+  m->nrects = 0; // keep the storage for the next layout
+  m->cols = m->rows = 0;
+}
+
+int hitmap_add(struct hitmap *m, int x, int y, int width, int height, int id) {
+  struct hit_rect *rects;
+  int capacity;
+
+  if (width <= 0 || height <= 0) return 0;
+
+  if (m->nrects == m->rects_capacity) {
+    capacity = m->rects_capacity ? m->rects_capacity * 2 : 16;
+    rects = realloc(m->rects, capacity * sizeof(*rects));
+    if (!rects) return -1;
+    m->rects = rects;
+    m->rects_capacity = capacity;
+  }
+
+  m->rects[m->nrects++] = (struct hit_rect){ { x, y, x + width, y + height }, id };
+  return 0;
+}
+
+static int add_candidate(struct hitmap *m, int rect) {
+  int *candidates;
+  int capacity;
+
+  if (m->ncandidates == m->candidates_capacity) {
+    capacity = m->candidates_capacity ? m->candidates_capacity * 2 : 64;
+    candidates = realloc(m->candidates, capacity * sizeof(*candidates));
+    if (!candidates) return -1;
+    m->candidates = candidates;
+    m->candidates_capacity = capacity;
+  }
+
+  m->candidates[m->ncandidates++] = rect;
+  return 0;
+}
+
+int hitmap_build(struct hitmap *m) {
+  struct hit_cell *cells;
+  struct box cell, *b;
+  int cols, rows, cx, cy, i;
+
+  cols = (m->width + HITMAP_CELL - 1) >> HITMAP_CELL_SHIFT;
+  rows = (m->height + HITMAP_CELL - 1) >> HITMAP_CELL_SHIFT;
+  if (cols <= 0 || rows <= 0) {
+    m->cols = m->rows = 0;
+    return 0;
+  }
+
+  if (cols * rows > m->cells_capacity) {
+    cells = realloc(m->cells, cols * rows * sizeof(*cells));
+    if (!cells) return -1;
+    m->cells = cells;
+    m->cells_capacity = cols * rows;
+  }
+  m->cols = cols;
+  m->rows = rows;
+  m->ncandidates = 0;
+
+  for (cy = 0; cy < rows; cy++) {
+    for (cx = 0; cx < cols; cx++) {
+      struct hit_cell *c = &m->cells[cy * cols + cx];
+
+      cell = (struct box){ cx << HITMAP_CELL_SHIFT, cy << HITMAP_CELL_SHIFT,
+                           (cx + 1) << HITMAP_CELL_SHIFT, (cy + 1) << HITMAP_CELL_SHIFT };
+      c->first = m->ncandidates;
+      for (i = 0; i < m->nrects; i++) {
+        b = &m->rects[i].box;
+        if (b->x2 <= cell.x1 || cell.x2 <= b->x1 || b->y2 <= cell.y1 || cell.y2 <= b->y1) continue;
+        if (add_candidate(m, i) < 0) return -1;
+        // covers the whole cell: nothing below it can be hit here
+        if (b->x1 <= cell.x1 && b->y1 <= cell.y1 && cell.x2 <= b->x2 && cell.y2 <= b->y2) break;
+      }
+      c->count = m->ncandidates - c->first;
+    }
+  }
+
+  return 0;
+}
+
+int hitmap_lookup(const struct hitmap *m, int x, int y) {
+  const struct hit_cell *c;
+  const struct box *b;
+  int i, r;
+
+  if (m->cols == 0) return m->default_id;
+
+  if (x < 0) x = 0;
+  if (y < 0) y = 0;
+  if (x >= m->width) x = m->width - 1;
+  if (y >= m->height) y = m->height - 1;
+
+  c = &m->cells[(y >> HITMAP_CELL_SHIFT) * m->cols + (x >> HITMAP_CELL_SHIFT)];
+  for (i = 0; i < c->count; i++) {
+    r = m->candidates[c->first + i];
+    b = &m->rects[r].box;
+    if (b->x1 <= x && x < b->x2 && b->y1 <= y && y < b->y2) return m->rects[r].id;
+  }
+
+  return m->default_id;
+}
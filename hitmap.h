@@ -0,0 +1,49 @@
+#ifndef HITMAP_H
+#define HITMAP_H
+
+#include "region.h"
+
+// Maps surface coordinates to whatever lives there (a resize edge, a drop
+// zone...). Rectangles are added once, when the layout changes, and
+// hitmap_build() sorts them into a grid of HITMAP_CELL-sized cells; a
+// lookup then only looks at the few rectangles that touch its cell, and a
+// cell entirely covered by one rectangle answers without any test at all.
+//
+// When rectangles overlap, the one added first wins. Points outside of the
+// map are clamped to its edges.
+#define HITMAP_CELL_SHIFT 4
+#define HITMAP_CELL (1 << HITMAP_CELL_SHIFT)
+
+struct hit_rect {
+  struct box box;
+  int id;
+};
+
+struct hit_cell {
+  int first, count; // into candidates
+};
+
+struct hitmap {
+  int width, height;
+  int default_id; // where no rectangle is
+
+  struct hit_rect *rects;
+  int nrects, rects_capacity;
+
+  int cols, rows;
+  struct hit_cell *cells;
+  int cells_capacity;
+  int *candidates; // rects indices, cell after cell
+  int ncandidates, candidates_capacity;
+};
+
+// A zero-initialised hitmap is valid and empty
+void hitmap_init(struct hitmap *m, int default_id);
+void hitmap_fini(struct hitmap *m);
+// Starts a new layout for a surface of that size
+void hitmap_reset(struct hitmap *m, int width, int height);
+int hitmap_add(struct hitmap *m, int x, int y, int width, int height, int id);
+int hitmap_build(struct hitmap *m);
+int hitmap_lookup(const struct hitmap *m, int x, int y);
+
+#endif
@@ -1,3 +1,7 @@
+// $ gcc -lwayland-client -lwayland-cursor input.c shm_pool.c os_compat.c pixel.c damage.c region.c raster.c cursor.c pointer.c hitmap.c frame_sched.c stats.c log.c event_loop.c key_repeat.c keymap_cache.c presentation-time-protocol.c -lpthread -lxkbcommon
+// $ wayland-scanner client-header /usr/share/wayland-protocols/stable/presentation-time/presentation-time.xml presentation-time-client-protocol.h
+// $ wayland-scanner private-code /usr/share/wayland-protocols/stable/presentation-time/presentation-time.xml presentation-time-protocol.c
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +15,20 @@
 #include <unistd.h>
 #include <linux/input.h>
 
+#include "shm_pool.h"
+#include "pixel.h"
+#include "damage.h"
+#include "raster.h"
+#include "cursor.h"
+#include "pointer.h"
+#include "hitmap.h"
+#include "frame_sched.h"
+#include "stats.h"
+#include "log.h"
+#include "event_loop.h"
+#include "key_repeat.h"
+#include "keymap_cache.h"
+
 #define MIN_WIN_WIDTH 30
 #define MIN_WIN_HEIGHT 60
 
@@ -19,147 +37,148 @@ unsigned win_height = 400;
 
 struct wl_display *display;
 struct wl_compositor *compositor;
+uint32_t compositor_version;
 struct wl_surface *surface;
 struct wl_shell *shell;
 struct wl_shell_surface *shell_surface;
 struct wl_shm *shm;
-struct wl_buffer *buffer;
+struct shm_pool *pool;
 struct wl_callback *frame_callback;
+struct wp_presentation *presentation;
+struct frame_sched *sched;
+struct stats *stats;
+struct event_loop *loop;
 struct wl_seat *seat;
 struct wl_pointer *pointer;
 struct wl_keyboard *keyboard;
-struct wl_cursor_theme *cursor_theme;
-struct wl_cursor *cursor;
-struct wl_surface *cursor_sfc;
+struct key_repeat *key_repeat;
+struct keymap_cache *keymap_cache;
+struct cursor_cache *cursors;
+struct pointer_frames *pointer_frames;
 
-void *shm_data;
+int waiting_for_buffer;
+struct raster *raster;
+struct shm_buffer *painting; // submitted to the raster, not committed yet
+int resize_pending;
+unsigned pending_width, pending_height;
 
-// Dealing with tmpfiles
-int set_cloexec_or_close(int fd) {
-  long flags;
-  if (fd == -1) return -1;
-  
-  flags = fcntl(fd, F_GETFD);
-  if (flags == -1) {
-    close(fd);
-    return -1;
-  }
+struct damage frame_damage; // what changed since the previous commit
 
-  if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
-    close(fd);
-    return -1;
-  }
+static const struct wl_callback_listener frame_listener;
+void layout_areas();
 
-  return fd;
-}
+// The raster is done with the tiles of `painting`: hand it over.
+void commit_frame() {
+  struct shm_buffer *buf = painting;
 
-int create_tmpfile_cloexec(char *tmpname) {
-#ifdef HAVE_MKOSTEMP
-  int fd = mkostemp(tmpname, O_CLOEXEC);
-  if (fd >= 0) unlink(tmpname);
-#else
-  int fd = mkstemp(tmpname);
-  if (fd >= 0) {
-    fd = set_cloexec_or_close(fd);
-    unlink(tmpname);
-  }
-#endif
+  painting = NULL;
+  damage_send(&frame_damage, surface, compositor_version);
+  frame_sched_commit(sched, surface);
+  stats_commit(stats);
+  damage_clear(&frame_damage);
 
-  return fd;
+  frame_callback = wl_surface_frame(surface);
+  wl_surface_attach(surface, buf->buffer, 0, 0);
+  wl_callback_add_listener(frame_callback, &frame_listener, NULL);
+  wl_surface_commit(surface);
 }
 
-int os_create_anonymous_file(off_t size) { // from Weston's implementation
-  static const char template[] = "/weston-shared-XXXXXX";
-  const char *path;
-  char *name;
-  int fd;
-
-  path = getenv("XDG_RUNTIME_DIR");
-  if (!path) {
-    errno = ENOENT;
-    return -1;
-  }
-
-  name = malloc(strlen(path) + sizeof(template));
-  if (!name) return -1;
-  strcpy(name, path);
-  strcat(name, template); // name += template
-
-  fd = create_tmpfile_cloexec(name);
-  free(name);
-  if (fd < 0) return -1;
-  if (ftruncate(fd, size) < 0) {
-    close(fd);
-    return -1;
-  }
+void paint_tile(void *data, const struct box *tile) {
+  struct shm_buffer *buf = data;
 
-  return fd;
+  pixel_fill_rect(shm_buffer_data(buf), buf->pool->stride, tile->x1, tile->y1, tile->x2 - tile->x1, tile->y2 - tile->y1, 0xff000000);
 }
 
-void paint_pixels() {
-  int n;
-  uint32_t *pixel = shm_data;
-
-  for (n = 0; n < win_width * win_height; n++) {
-    pixel[n] = 0xff000000;
+// Only rasterize what this buffer has missed since it was last attached.
+// The tiles are painted on the raster threads; the dispatch thread goes
+// back to handling events and commits when raster_get_fd() fires.
+void paint_pixels(struct shm_buffer *buf) {
+  const struct box *b;
+  int i, n;
+
+  painting = buf;
+  b = damage_boxes(&buf->damage, &n);
+  if (raster_submit(raster, b, n, paint_tile, buf) < 0) {
+    for (i = 0; i < n; i++) paint_tile(buf, &b[i]);
+    damage_clear(&buf->damage);
+    commit_frame();
+    return;
   }
+  damage_clear(&buf->damage); // the raster has its own copy of the boxes
 }
 
-static const struct wl_callback_listener frame_listener;
-
 uint32_t ht;
 
 void redraw(void *data, struct wl_callback *callback, uint32_t time) {
-  wl_callback_destroy(frame_callback);
-  wl_surface_damage(surface, 0, 0, win_width, win_height);
-  paint_pixels();
-  frame_callback = wl_surface_frame(surface);
-  wl_surface_attach(surface, buffer, 0, 0);
-  wl_callback_add_listener(frame_callback, &frame_listener, NULL);
-  wl_surface_commit(surface);
-}
+  struct shm_buffer *buf;
 
-static const struct wl_callback_listener frame_listener = {
-  redraw
-};
+  if (frame_callback) wl_callback_destroy(frame_callback);
+  frame_callback = NULL;
 
-struct wl_buffer *create_buffer() {
-  struct wl_shm_pool *pool;
-  int line = win_width * 4; // 4 bytes/px
-  int size = line * win_height;
-  int fd;
-  struct wl_buffer *buf;
+  if (pointer_frames) pointer_frames_flush(pointer_frames); // the motion held back since the last frame
 
-  ht = win_height;
+  if (resize_pending) {
+    resize_pending = 0;
+    win_width = pending_width;
+    win_height = pending_height;
+    shm_pool_resize(pool, win_width, win_height);
+    damage_add(&frame_damage, 0, 0, win_width, win_height);
+    layout_areas();
+  }
 
-  fd = os_create_anonymous_file(size);
-  if (fd < 0) {
-    printf("Failed to create a buffer which has the size of %d\n", size);
-    exit(1);
+  buf = shm_pool_next_buffer(pool);
+  if (buf == NULL) {
+    // the compositor holds every buffer; buffer_released() picks it up again
+    waiting_for_buffer = 1;
+    return;
   }
 
-  shm_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (shm_data == MAP_FAILED) {
-    printf("mmap failed: %m\n");
-    close(fd);
-    exit(1);
+  frame_sched_begin(sched);
+  stats_paint_begin(stats);
+  paint_pixels(buf); // commit_frame() follows once the tiles are done
+}
+
+// Don't paint yet: the scheduler knows when the next vblank is and starts
+// us as late as it safely can (see frame_sched.h).
+void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+  wl_callback_destroy(callback);
+  frame_callback = NULL;
+
+  stats->dropped = sched->missed + sched->discarded;
+  if (stats_frame_done(stats)) {
+    event_loop_quit(loop);
+    return;
   }
+  if (frame_sched_schedule(sched)) redraw(NULL, NULL, time);
+}
 
-  pool = wl_shm_create_pool(shm, fd, size);
-  buf = wl_shm_pool_create_buffer(pool, 0, win_width, win_height, line, WL_SHM_FORMAT_ARGB8888);
-  
-  wl_shm_pool_destroy(pool);
-  return buf;
+static const struct wl_callback_listener frame_listener = {
+  frame_done
+};
+
+void buffer_released(void *data, struct shm_buffer *buf) {
+  if (waiting_for_buffer) {
+    waiting_for_buffer = 0;
+    redraw(NULL, NULL, 0);
+  }
+}
+
+struct shm_pool *create_pool() {
+  struct shm_pool *p = shm_pool_create(shm, win_width, win_height, WL_SHM_FORMAT_ARGB8888, 2); // double buffering
+  if (p == NULL) exit(1);
+  p->release = buffer_released;
+  return p;
 }
 
 void create_window() {
-  buffer = create_buffer();
-  wl_surface_attach(surface, buffer, 0, 0);
-  wl_surface_commit(surface);
+  ht = win_height;
+  pool = create_pool();
+  damage_add(&frame_damage, 0, 0, win_width, win_height);
+  layout_areas();
 }
 
 void shm_format(void *data, struct wl_shm *wl_shm, uint32_t format) {
-  printf("Format %d\n", format);
+  log_debug("Format %d\n", format);
 }
 
 struct wl_shm_listener shm_listener = {
@@ -167,30 +186,43 @@ struct wl_shm_listener shm_listener = {
 };
 
 void keymap(void *data, struct wl_keyboard *kbd, uint32_t format, int32_t fd, uint32_t size) {
-
+  if (keymap_cache_load(keymap_cache, format, fd, size) < 0) log_warn("Could not load the keymap (format %u)\n", format);
 }
 
 void keyboard_enter(void *data, struct wl_keyboard *kbd, uint32_t serial, struct wl_surface *sfc, struct wl_array *keys) {
-  printf("Keyboard entered a surface\n");
+  log_info("Keyboard entered a surface\n");
 }
 
 void keyboard_leave(void *data, struct wl_keyboard *kbd, uint32_t serial, struct wl_surface *sfc) {
-  printf("Keyboard left the surface\n");
+  log_info("Keyboard left the surface\n");
+  key_repeat_stop(key_repeat);
 }
 
 void key(void *data, struct wl_keyboard *kbd, uint32_t serial, uint32_t time, uint32_t key, uint32_t state) {
-  printf("%d was %s\n", key, state == WL_KEYBOARD_KEY_STATE_PRESSED ? "pressed" : "released");
+  const struct keymap_key *k = keymap_cache_lookup(keymap_cache, key);
+
+  log_info("%d (sym 0x%x \"%s\") was %s\n", key, k ? k->sym : 0, k ? k->utf8 : "", state == WL_KEYBOARD_KEY_STATE_PRESSED ? "pressed" : "released");
+  if (state == WL_KEYBOARD_KEY_STATE_RELEASED || !k || k->repeats) key_repeat_key(key_repeat, key, state);
+}
+
+// `count` repeats at once if we were too busy to take them one by one
+void key_repeated(void *data, uint32_t key, uint32_t count) {
+  const struct keymap_key *k = keymap_cache_lookup(keymap_cache, key);
+
+  log_info("%d (\"%s\") repeated (x%u)\n", key, k ? k->utf8 : "", count);
 }
 
 void modifiers(void *data, struct wl_keyboard *kbd, uint32_t serial, uint32_t mods_depressed, uint32_t mods_latched, uint32_t mods_locked, uint32_t group) {
-  printf(
+  keymap_cache_set_modifiers(keymap_cache, mods_depressed, mods_latched, mods_locked, group);
+  log_info(
     "Mods Depressed: %d\n"
     "Mods Latched: %d\n"
     "Mods Locked: %d\n", mods_depressed, mods_latched, mods_locked);
 }
 
 void repeat_info(void *data, struct wl_keyboard *kbd, int32_t rate, int32_t delay) {
-
+  log_info("Key repeat: %d/s after %dms\n", rate, delay);
+  key_repeat_set_info(key_repeat, rate, delay);
 }
 
 struct wl_keyboard_listener keyboard_listener = {
@@ -202,24 +234,6 @@ struct wl_keyboard_listener keyboard_listener = {
   repeat_info
 };
 
-void refresh_cursor() {
-  struct wl_cursor_image *cursor_image = cursor->images[0];
-  struct wl_buffer *cursor_buf = wl_cursor_image_get_buffer(cursor_image);
-  cursor_sfc = wl_compositor_create_surface(compositor);
-  wl_surface_attach(cursor_sfc, cursor_buf, 0, 0);
-  wl_surface_damage(cursor_sfc, 0, 0, cursor_image->width, cursor_image->height);
-  wl_surface_commit(cursor_sfc);
-  wl_pointer_set_cursor(pointer, 0, cursor_sfc, cursor_image->hotspot_x, cursor_image->hotspot_y); // serial?
-}
-
-void pointer_enter(void *data, struct wl_pointer *ptr, uint32_t serial, struct wl_surface *sfc, wl_fixed_t sfc_x, wl_fixed_t sfc_y) {
-  refresh_cursor();
-}
-
-void pointer_leave(void *data, struct wl_pointer *ptr, uint32_t serial, struct wl_surface *sfc) {
-
-}
-
 // These names are correspoinding to enum wl_shell_surface_resize (wayland-client-protocol.h)
 // (but NONE corresponds to "move")
 const char *cur_name[] = {
@@ -230,23 +244,39 @@ const char *cur_name[] = {
 
 enum wl_shell_surface_resize area;
 wl_fixed_t sx, sy;
+struct hitmap areas; // resize edges, the rest moves the window
+
+// Rebuilt only when the size changes. The corners go first so that they win
+// over the edges they overlap.
+void layout_areas() {
+  int w = win_width, h = win_height;
+  int right = w - FRAME_WIDTH + 1, bottom = h - FRAME_WIDTH + 1;
+
+  hitmap_reset(&areas, w, h);
+  hitmap_add(&areas, 0, 0, FRAME_WIDTH, FRAME_WIDTH, WL_SHELL_SURFACE_RESIZE_TOP_LEFT);
+  hitmap_add(&areas, right, 0, w - right, FRAME_WIDTH, WL_SHELL_SURFACE_RESIZE_TOP_RIGHT);
+  hitmap_add(&areas, 0, bottom, FRAME_WIDTH, h - bottom, WL_SHELL_SURFACE_RESIZE_BOTTOM_LEFT);
+  hitmap_add(&areas, right, bottom, w - right, h - bottom, WL_SHELL_SURFACE_RESIZE_BOTTOM_RIGHT);
+  hitmap_add(&areas, 0, 0, FRAME_WIDTH, h, WL_SHELL_SURFACE_RESIZE_LEFT);
+  hitmap_add(&areas, right, 0, w - right, h, WL_SHELL_SURFACE_RESIZE_RIGHT);
+  hitmap_add(&areas, 0, 0, w, FRAME_WIDTH, WL_SHELL_SURFACE_RESIZE_TOP);
+  hitmap_add(&areas, 0, bottom, w, h - bottom, WL_SHELL_SURFACE_RESIZE_BOTTOM);
+  if (hitmap_build(&areas) < 0) {
+    perror("Could not lay out the resize areas\n");
+    exit(1);
+  }
+}
 
-void motion(void *data, struct wl_pointer *ptr, uint32_t time, wl_fixed_t sfc_x, wl_fixed_t sfc_y) {
+void update_area(wl_fixed_t sfc_x, wl_fixed_t sfc_y) {
   sx = sfc_x >> 8;
   sy = sfc_y >> 8;
 
-  area = WL_SHELL_SURFACE_RESIZE_NONE;
-  if (sx < FRAME_WIDTH) area |= WL_SHELL_SURFACE_RESIZE_LEFT;
-  if (sx > win_width - FRAME_WIDTH) area |= WL_SHELL_SURFACE_RESIZE_RIGHT;
-  if (sy < FRAME_WIDTH) area |= WL_SHELL_SURFACE_RESIZE_TOP;
-  if (sy > win_height - FRAME_WIDTH) area |= WL_SHELL_SURFACE_RESIZE_BOTTOM;
-
-  cursor = wl_cursor_theme_get_cursor(cursor_theme, cur_name[area]);
-  refresh_cursor();
+  area = hitmap_lookup(&areas, sx, sy);
+  cursor_cache_set(cursors, area); // a no-op unless the area changed
 }
 
-void button(void *data, struct wl_pointer *ptr, uint32_t serial, uint32_t time, uint32_t button, uint32_t state) {
-  printf("A button was pushed at (%d, %d)\n", sx, sy);
+void button(uint32_t serial, uint32_t button, uint32_t state) {
+  log_info("A button was pushed at (%d, %d)\n", sx, sy);
 
   if (button == BTN_RIGHT) {
     exit(0);
@@ -261,38 +291,25 @@ void button(void *data, struct wl_pointer *ptr, uint32_t serial, uint32_t time,
   }
 }
 
-void axis(void *data, struct wl_pointer *ptr, uint32_t time, uint32_t axis, wl_fixed_t value) {
-  printf("Axis: %d %d\n", axis, value);
-}
+// One call per wl_pointer.frame, or per frame of ours for plain motion
+// (see pointer.h)
+void pointer_frame(void *data, const struct pointer_event *ev) {
+  int i;
 
-void frame(void *data, struct wl_pointer *ptr) {
-  printf("-- Frame Ended --\n");
-}
+  if (ev->mask & POINTER_ENTER) cursor_cache_enter(cursors, pointer, ev->serial);
+  if (ev->mask & (POINTER_ENTER | POINTER_MOTION)) update_area(ev->x, ev->y);
 
-void axis_source(void *data, struct wl_pointer *ptr, uint32_t axis_source) {
-  printf("Axis source: %d", axis_source);
-}
+  for (i = 0; i < ev->nbuttons; i++) button(ev->buttons[i].serial, ev->buttons[i].button, ev->buttons[i].state);
 
-void axis_stop(void *data, struct wl_pointer *ptr, uint32_t time, uint32_t axis) {
-  printf("Axis stopped: %d", axis);
-}
+  if (ev->mask & POINTER_AXIS) {
+    log_info("Axis: %d %d (discrete %d %d)\n", ev->axis[0], ev->axis[1], ev->discrete[0], ev->discrete[1]);
+  }
+  if (ev->mask & POINTER_AXIS_SOURCE) log_info("Axis source: %d\n", ev->axis_source);
+  if (ev->mask & POINTER_AXIS_STOP) log_info("Axis stopped: %d\n", ev->axis_stop);
 
-void axis_discrete(void *data, struct wl_pointer *ptr, uint32_t axis, int32_t discrete) {
-  printf("Axis discrete: %d %d", axis, discrete);
+  if (ev->mask & POINTER_LEAVE) cursor_cache_leave(cursors);
 }
 
-struct wl_pointer_listener pointer_listener = {
-  .enter = pointer_enter,
-  .leave = pointer_leave,
-  .motion = motion,
-  .button = button,
-  .axis = axis,
-  .frame = frame,
-  .axis_source = axis_source,
-  .axis_stop = axis_stop,
-  .axis_discrete = axis_discrete
-};
-
 void seat_capabilities(void *data, struct wl_seat *seat, uint32_t capabilities) {
   if ((capabilities & WL_SEAT_CAPABILITY_KEYBOARD) && !keyboard) {
     keyboard = wl_seat_get_keyboard(seat);
@@ -300,23 +317,30 @@ void seat_capabilities(void *data, struct wl_seat *seat, uint32_t capabilities)
   }
 
   if (!(capabilities & WL_SEAT_CAPABILITY_KEYBOARD) && keyboard) {
+    key_repeat_stop(key_repeat);
     wl_keyboard_release(keyboard);
+    keyboard = NULL;
   }
 
   if ((capabilities & WL_SEAT_CAPABILITY_POINTER) && !pointer) {
     pointer = wl_seat_get_pointer(seat);
-    wl_pointer_add_listener(pointer, &pointer_listener, NULL);
+    pointer_frames = pointer_frames_create(pointer, pointer_frame, NULL);
+    if (pointer_frames == NULL) exit(1);
+    pointer_frames->per_display_frame = 1; // we redraw continuously anyway
   }
 
   if (!(capabilities & WL_SEAT_CAPABILITY_POINTER) && pointer) {
+    pointer_frames_destroy(pointer_frames);
+    pointer_frames = NULL;
     wl_pointer_release(pointer);
+    pointer = NULL;
   }
 
   // ignore touchpad etc.
 }
 
 void seat_name(void *data, struct wl_seat *seat, const char *name) {
-  printf("Seat name: %s", name);
+  log_info("Seat name: %s", name);
 }
 
 struct wl_seat_listener seat_listener = {
@@ -325,15 +349,21 @@ struct wl_seat_listener seat_listener = {
 };
 
 void global_add(void *data, struct wl_registry *registry, uint32_t id, const char *interface, uint32_t version) {
-  printf("Added: %s, %d\n", interface, id);
+  log_debug("Added: %s, %d\n", interface, id);
   if (strcmp(interface, "wl_compositor") == 0) {
-    compositor = wl_registry_bind(registry, id, &wl_compositor_interface, 1);
+    compositor_version = version < 4 ? version : 4; // 4 for wl_surface.damage_buffer
+    compositor = wl_registry_bind(registry, id, &wl_compositor_interface, compositor_version);
   }
 
   if (strcmp(interface, "wl_shell") == 0) {
     shell = wl_registry_bind(registry, id, &wl_shell_interface, 1);
   }
 
+  if (strcmp(interface, "wp_presentation") == 0) {
+    presentation = wl_registry_bind(registry, id, &wp_presentation_interface, 1);
+    frame_sched_set_presentation(sched, presentation);
+  }
+
   if (strcmp(interface, "wl_shm") == 0) {
     shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
     wl_shm_add_listener(shm, &shm_listener, NULL);
@@ -346,7 +376,7 @@ void global_add(void *data, struct wl_registry *registry, uint32_t id, const cha
 }
 
 void global_remove(void *data, struct wl_registry *registry, uint32_t id) {
-  printf("Removed: %d\n", id);
+  log_debug("Removed: %d\n", id);
 }
 
 struct wl_registry_listener registry_listener = {
@@ -357,7 +387,7 @@ struct wl_registry_listener registry_listener = {
 // Shell surface listeners
 void handle_ping(void *data, struct wl_shell_surface *shell_surface, uint32_t serial) {
   wl_shell_surface_pong(shell_surface, serial);
-  printf("Pong\n");
+  log_debug("Pong\n");
 }
 
 void handle_configure(void *data, struct wl_shell_surface *shell_surface, uint32_t edges, int32_t width, int32_t height) {
@@ -365,13 +395,13 @@ void handle_configure(void *data, struct wl_shell_surface *shell_surface, uint32
   int32_t w = width, h = height;
   if (w < MIN_WIN_WIDTH) w = MIN_WIN_WIDTH;
   if (h < MIN_WIN_HEIGHT) h = MIN_WIN_HEIGHT;
-  fprintf(stderr, "hoge, w: %d, h: %d\n", w, h);
-
-  wl_buffer_destroy(buffer);
+  log_debug("hoge, w: %d, h: %d\n", w, h);
 
-  win_width = w;
-  win_height = h;
-  buffer = create_buffer();
+  // An interactive resize sends a storm of these; only the latest one is
+  // applied, once per frame callback (see redraw()).
+  pending_width = w;
+  pending_height = h;
+  resize_pending = 1;
 }
 
 void handle_popup_done(void *data, struct wl_shell_surface *shell_surface) {
@@ -384,7 +414,33 @@ struct wl_shell_surface_listener shell_surface_listener = {
   handle_popup_done
 };
 
+// Event loop sources
+void raster_ready(void *data, int fd, uint32_t events) {
+  if (raster_finish(raster)) commit_frame();
+}
+
+void sched_ready(void *data, int fd, uint32_t events) {
+  if (frame_sched_ready(sched)) redraw(NULL, NULL, 0);
+}
+
+void stats_signal(void *data, int fd, uint32_t events) {
+  if (stats_handle_signal(stats) < 0) event_loop_quit(loop);
+}
+
+void dispatch_observer(void *data, int phase) {
+  if (phase == EVENT_LOOP_DISPATCH_BEGIN) stats_dispatch_begin(stats);
+  else stats_dispatch_end(stats);
+}
+
 int main(int argc, char **argv) {
+  // before any thread gets started, see stats_create()
+  stats = stats_create("input");
+  if (stats == NULL) {
+    perror("Could not set up the frame statistics\n");
+    exit(1);
+  }
+  if (log_init() < 0) perror("Could not start the log thread, logging synchronously\n");
+
   display = wl_display_connect(NULL);
   if (display == NULL) {
     perror("Can't connect to the display\n");
@@ -392,6 +448,26 @@ int main(int argc, char **argv) {
   }
   printf("connected to the display\n");
 
+  // before the seat shows up: repeat_info may come with the first roundtrip
+  loop = event_loop_create(display);
+  key_repeat = loop ? key_repeat_create(loop, key_repeated, NULL) : NULL;
+  if (key_repeat == NULL) {
+    perror("Could not create the event loop\n");
+    exit(1);
+  }
+  keymap_cache = keymap_cache_create();
+  if (keymap_cache == NULL) {
+    perror("Could not create the xkb context\n");
+    exit(1);
+  }
+
+  char *margin = getenv("FRAME_MARGIN_US"); // how long before the vblank we must have committed
+  sched = frame_sched_create(margin ? atoi(margin) : 0);
+  if (sched == NULL) {
+    perror("Could not create the frame scheduler\n");
+    exit(1);
+  }
+
   struct wl_registry *registry = wl_display_get_registry(display);
   wl_registry_add_listener(registry, &registry_listener, NULL);
   
@@ -412,9 +488,9 @@ int main(int argc, char **argv) {
     printf("Found shell!\n");
   }
 
+  // e.g. weston's headless backend: still draw (and benchmark), no input
   if (seat == NULL) {
-    perror("Could not find any seat\n");
-    exit(1);
+    log_warn("Could not find any seat, running without input\n");
   } else {
     printf("Found seat\n");
   }
@@ -427,9 +503,8 @@ int main(int argc, char **argv) {
     printf("Created a surface\n");
   }
 
-  cursor_theme = wl_cursor_theme_load(NULL, 32, shm);
-  cursor = wl_cursor_theme_get_cursor(cursor_theme, "text");
-  if (cursor == NULL) {
+  cursors = cursor_cache_create(compositor, shm, 32, cur_name, sizeof(cur_name) / sizeof(cur_name[0]));
+  if (cursors == NULL) {
     perror("Could not get a cursor\n");
     exit(1);
   } else {
@@ -449,17 +524,36 @@ int main(int argc, char **argv) {
   frame_callback = wl_surface_frame(surface);
   wl_callback_add_listener(frame_callback, &frame_listener, NULL);
 
+  raster = raster_create(0);
+  if (raster == NULL) {
+    perror("Could not start the raster threads\n");
+    exit(1);
+  }
+
+  if (!event_loop_add_fd(loop, raster_get_fd(raster), EPOLLIN, raster_ready, NULL) ||
+      !event_loop_add_fd(loop, frame_sched_get_fd(sched), EPOLLIN, sched_ready, NULL) ||
+      !event_loop_add_fd(loop, stats_get_fd(stats), EPOLLIN, stats_signal, NULL)) {
+    perror("Could not create the event loop\n");
+    exit(1);
+  }
+  event_loop_set_observer(loop, dispatch_observer, NULL);
+
   create_window();
   redraw(NULL, NULL, 0);
 
-  while (wl_display_dispatch(display) != -1) {
-    // do nothing
-  }
+  event_loop_run(loop);
 
-  wl_seat_release(seat);
-  wl_cursor_theme_destroy(cursor_theme);
-  wl_surface_destroy(cursor_sfc);
+  if (seat) wl_seat_release(seat);
+  cursor_cache_destroy(cursors);
+  hitmap_fini(&areas);
 
+  key_repeat_destroy(key_repeat);
+  keymap_cache_destroy(keymap_cache);
+  event_loop_destroy(loop);
+  raster_destroy(raster);
+  frame_sched_destroy(sched);
+  if (presentation) wp_presentation_destroy(presentation);
+  stats_destroy(stats);
   wl_display_disconnect(display);
   printf("disconnected from the display\n");
 
@@ -0,0 +1,65 @@
+#include <stdlib.h>
+#include <time.h>
+#include <wayland-client.h>
+
+#include "key_repeat.h"
+
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_SEC 1000000000ull
+
+static void repeat(void *data, uint64_t expirations) {
+  struct key_repeat *r = data;
+
+  if (!r->active || expirations == 0) return;
+  r->func(r->data, r->key, expirations > UINT32_MAX ? UINT32_MAX : expirations);
+}
+
+struct key_repeat *key_repeat_create(struct event_loop *loop, key_repeat_func func, void *data) {
+  struct key_repeat *r = calloc(1, sizeof(*r));
+
+  if (!r) return NULL;
+
+  r->func = func;
+  r->data = data;
+  r->rate = KEY_REPEAT_DEFAULT_RATE;
+  r->delay = KEY_REPEAT_DEFAULT_DELAY;
+
+  r->timer = event_loop_add_timer(loop, CLOCK_MONOTONIC, repeat, r);
+  if (!r->timer) {
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+void key_repeat_destroy(struct key_repeat *r) {
+  if (!r) return;
+  event_loop_remove(r->timer);
+  free(r);
+}
+
+void key_repeat_set_info(struct key_repeat *r, int32_t rate, int32_t delay) {
+  r->rate = rate > 0 ? rate : 0;
+  r->delay = delay > 0 ? delay : 0;
+  if (r->rate == 0) key_repeat_stop(r);
+}
+
+void key_repeat_key(struct key_repeat *r, uint32_t key, uint32_t state) {
+  if (state == WL_KEYBOARD_KEY_STATE_RELEASED) {
+    // releasing some other key doesn't stop the one repeating
+    if (r->active && r->key == key) key_repeat_stop(r);
+    return;
+  }
+
+  if (r->rate == 0) return;
+
+  r->key = key;
+  r->active = 1;
+  event_loop_timer_arm(r->timer, r->delay * NSEC_PER_MSEC, NSEC_PER_SEC / r->rate, 0);
+}
+
+void key_repeat_stop(struct key_repeat *r) {
+  if (!r->active) return;
+  r->active = 0;
+  event_loop_timer_disarm(r->timer);
+}
@@ -0,0 +1,42 @@
+#ifndef KEY_REPEAT_H
+#define KEY_REPEAT_H
+
+#include <stdint.h>
+
+#include "event_loop.h"
+
+// Client-side key repeat, as wl_keyboard leaves it to us. The compositor
+// tells the rate and delay (wl_keyboard.repeat_info); a press arms a
+// timerfd on the event loop for the delay, then ticks at the rate until
+// the key is released or the keyboard leaves.
+//
+// If the loop was busy (a stalled frame) and several repeats are due at
+// once, the callback runs once with their count instead of once per
+// repeat, so a 50Hz repeat never costs more than one call per wakeup.
+//
+// Until repeat_info arrives (wl_seat before version 4 never sends it) the
+// usual 25Hz after 600ms is used. A rate of 0 turns repeating off.
+#define KEY_REPEAT_DEFAULT_RATE 25 // per second
+#define KEY_REPEAT_DEFAULT_DELAY 600 // ms
+
+typedef void (*key_repeat_func)(void *data, uint32_t key, uint32_t count);
+
+struct key_repeat {
+  struct event_source *timer;
+  key_repeat_func func;
+  void *data;
+
+  int32_t rate, delay;
+  uint32_t key; // the one repeating
+  int active;
+};
+
+struct key_repeat *key_repeat_create(struct event_loop *loop, key_repeat_func func, void *data);
+void key_repeat_destroy(struct key_repeat *r);
+// wl_keyboard.repeat_info
+void key_repeat_set_info(struct key_repeat *r, int32_t rate, int32_t delay);
+// wl_keyboard.key: a press repeats that key from now on, its release stops it
+void key_repeat_key(struct key_repeat *r, uint32_t key, uint32_t state);
+void key_repeat_stop(struct key_repeat *r);
+
+#endif
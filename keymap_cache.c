@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <wayland-client.h>
+
+#include "keymap_cache.h"
+
+#define EVDEV_OFFSET 8 // xkb keycodes are evdev codes + 8
+
+struct keymap_cache *keymap_cache_create() {
+  struct keymap_cache *c = calloc(1, sizeof(*c));
+
+  if (!c) return NULL;
+
+  c->context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+  if (!c->context) {
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+static void unload(struct keymap_cache *c) {
+  int i;
+
+  if (c->state) xkb_state_unref(c->state);
+  if (c->keymap) xkb_keymap_unref(c->keymap);
+  c->state = NULL;
+  c->keymap = NULL;
+
+  for (i = 0; i < KEYMAP_CACHE_PAGES; i++) c->pages[i].valid = 0;
+  c->page = NULL;
+}
+
+void keymap_cache_destroy(struct keymap_cache *c) {
+  if (!c) return;
+  unload(c);
+  xkb_context_unref(c->context);
+  free(c);
+}
+
+// The table for the modifiers and group the state is in now
+static void select_page(struct keymap_cache *c) {
+  xkb_mod_mask_t mods = xkb_state_serialize_mods(c->state, XKB_STATE_MODS_EFFECTIVE);
+  xkb_layout_index_t group = xkb_state_serialize_layout(c->state, XKB_STATE_LAYOUT_EFFECTIVE);
+  struct keymap_page *p, *victim = &c->pages[0];
+  int i;
+
+  c->clock++;
+  if (c->page && c->page->mods == mods && c->page->group == group) {
+    c->page->last_used = c->clock;
+    return;
+  }
+
+  for (i = 0; i < KEYMAP_CACHE_PAGES; i++) {
+    p = &c->pages[i];
+    if (p->valid && p->mods == mods && p->group == group) {
+      p->last_used = c->clock;
+      c->page = p;
+      return;
+    }
+    if (!p->valid || (victim->valid && p->last_used < victim->last_used)) victim = p;
+  }
+
+  // least recently used (or never used) one starts over
+  memset(victim->keys, 0, sizeof(victim->keys));
+  victim->mods = mods;
+  victim->group = group;
+  victim->last_used = c->clock;
+  victim->valid = 1;
+  c->page = victim;
+}
+
+int keymap_cache_load(struct keymap_cache *c, uint32_t format, int fd, uint32_t size) {
+  struct xkb_keymap *keymap;
+  struct xkb_state *state;
+  char *map;
+
+  if (format != WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1 || size == 0) {
+    close(fd);
+    return -1;
+  }
+
+  // MAP_PRIVATE: from wl_keyboard version 7 on, MAP_SHARED may fail
+  map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+
+  // `size` counts the terminating '\0'
+  keymap = xkb_keymap_new_from_buffer(c->context, map, strnlen(map, size), XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS);
+  munmap(map, size);
+  if (!keymap) return -1;
+
+  state = xkb_state_new(keymap);
+  if (!state) {
+    xkb_keymap_unref(keymap);
+    return -1;
+  }
+
+  unload(c);
+  c->keymap = keymap;
+  c->state = state;
+  select_page(c);
+  return 0;
+}
+
+void keymap_cache_set_modifiers(struct keymap_cache *c, uint32_t depressed, uint32_t latched, uint32_t locked, uint32_t group) {
+  if (!c->state) return;
+
+  xkb_state_update_mask(c->state, depressed, latched, locked, 0, 0, group);
+  select_page(c);
+}
+
+static void fill(struct keymap_cache *c, uint32_t key, struct keymap_key *k) {
+  xkb_keycode_t code = key + EVDEV_OFFSET;
+
+  k->sym = xkb_state_key_get_one_sym(c->state, code);
+  if (xkb_state_key_get_utf8(c->state, code, k->utf8, sizeof(k->utf8)) >= (int)sizeof(k->utf8)) {
+    k->utf8[0] = '\0'; // wouldn't fit, not a single character anyway
+  }
+  k->repeats = xkb_keymap_key_repeats(c->keymap, code);
+  k->cached = 1;
+}
+
+const struct keymap_key *keymap_cache_lookup(struct keymap_cache *c, uint32_t key) {
+  struct keymap_key *k;
+
+  if (!c->state) return NULL;
+
+  if (key >= KEYMAP_CACHE_KEYS) {
+    fill(c, key, &c->uncached);
+    return &c->uncached;
+  }
+
+  k = &c->page->keys[key];
+  if (!k->cached) fill(c, key, k);
+  return k;
+}
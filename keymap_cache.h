@@ -0,0 +1,55 @@
+#ifndef KEYMAP_CACHE_H
+#define KEYMAP_CACHE_H
+
+#include <stdint.h>
+#include <xkbcommon/xkbcommon.h>
+
+// Turns the evdev key codes of wl_keyboard.key into keysyms and text.
+//
+// The keymap fd is mapped read-only and handed to xkbcommon as it is (no
+// copy into our memory), and compiled once per wl_keyboard.keymap. The
+// xkb state only runs when the modifiers change; a key press looks its
+// result up in a flat table for the current (modifiers, group), filled
+// the first time each key is seen. A few such tables are kept, so going
+// back and forth between, say, plain and Shift doesn't start over.
+#define KEYMAP_CACHE_KEYS 256 // evdev codes above this ask xkb every time
+#define KEYMAP_CACHE_PAGES 4 // modifier/group combinations kept
+#define KEYMAP_CACHE_UTF8 16
+
+struct keymap_key {
+  xkb_keysym_t sym;
+  char utf8[KEYMAP_CACHE_UTF8]; // "" if the key doesn't type anything
+  uint8_t cached;
+  uint8_t repeats;
+};
+
+struct keymap_page {
+  xkb_mod_mask_t mods; // effective
+  xkb_layout_index_t group; // effective
+  uint32_t last_used;
+  int valid;
+  struct keymap_key keys[KEYMAP_CACHE_KEYS];
+};
+
+struct keymap_cache {
+  struct xkb_context *context;
+  struct xkb_keymap *keymap;
+  struct xkb_state *state;
+
+  struct keymap_page pages[KEYMAP_CACHE_PAGES];
+  struct keymap_page *page; // for the current modifiers
+  uint32_t clock;
+  struct keymap_key uncached; // returned for keys beyond the table
+};
+
+struct keymap_cache *keymap_cache_create();
+void keymap_cache_destroy(struct keymap_cache *c);
+// wl_keyboard.keymap; takes the fd (it gets closed)
+int keymap_cache_load(struct keymap_cache *c, uint32_t format, int fd, uint32_t size);
+// wl_keyboard.modifiers
+void keymap_cache_set_modifiers(struct keymap_cache *c, uint32_t depressed, uint32_t latched, uint32_t locked, uint32_t group);
+// `key` as in wl_keyboard.key. NULL until a keymap was loaded. Valid until
+// the next call.
+const struct keymap_key *keymap_cache_lookup(struct keymap_cache *c, uint32_t key);
+
+#endif
@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+#define RING_MASK (LOG_RING_SIZE - 1)
+#define OUT_SIZE 4096
+
+struct log_record {
+  atomic_size_t seq; // == position + 1 once written, position + LOG_RING_SIZE once consumed
+  const char *fmt;
+  int level;
+  int nspecs;   // how many conversions the arguments cover, -1: all
+  unsigned char data[LOG_RECORD_DATA];
+};
+
+// One conversion specification, as in "%-8.*lld"
+struct spec {
+  const char *start; // the '%'
+  int prefix_len;    // "%-8.*", without the length modifier
+  char conv;
+  int length;        // LEN_*
+  int star_width, star_prec;
+};
+
+enum { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_Z, LEN_J, LEN_T, LEN_BIG_L };
+
+static struct log_record ring[LOG_RING_SIZE];
+static atomic_size_t head;
+static size_t tail; // only touched by the flusher
+static atomic_ullong dropped;
+
+static pthread_t thread;
+static int running;
+static int wake_fd = -1;
+static atomic_int sleeping, quit;
+
+// p points right after the '%'. Returns where the specification ends.
+static const char *parse_spec(const char *p, struct spec *s) {
+  s->start = p - 1;
+  s->star_width = s->star_prec = 0;
+  s->length = LEN_NONE;
+
+  while (*p && strchr("-+ #0'", *p)) p++;
+  if (*p == '*') {
+    s->star_width = 1;
+    p++;
+  }
+  while (*p >= '0' && *p <= '9') p++;
+  if (*p == '.') {
+    p++;
+    if (*p == '*') {
+      s->star_prec = 1;
+      p++;
+    }
+    while (*p >= '0' && *p <= '9') p++;
+  }
+  s->prefix_len = p - s->start;
+
+  switch (*p) {
+  case 'h':
+    s->length = p[1] == 'h' ? LEN_HH : LEN_H;
+    p += p[1] == 'h' ? 2 : 1;
+    break;
+  case 'l':
+    s->length = p[1] == 'l' ? LEN_LL : LEN_L;
+    p += p[1] == 'l' ? 2 : 1;
+    break;
+  case 'z': s->length = LEN_Z; p++; break;
+  case 'j': s->length = LEN_J; p++; break;
+  case 't': s->length = LEN_T; p++; break;
+  case 'L': s->length = LEN_BIG_L; p++; break;
+  }
+
+  s->conv = *p;
+  return *p ? p + 1 : p;
+}
+
+static int is_float(char conv) {
+  return conv && strchr("eEfFgGaA", conv) != NULL;
+}
+
+// Argument packing, on the caller's thread: no formatting, just copies.
+
+struct packer {
+  unsigned char *p, *end;
+};
+
+static int pack(struct packer *pk, const void *v, size_t size) {
+  if (pk->p + size > pk->end) return -1;
+  memcpy(pk->p, v, size);
+  pk->p += size;
+  return 0;
+}
+
+static int pack_int(struct packer *pk, long long v) {
+  return pack(pk, &v, sizeof(v));
+}
+
+static int pack_string(struct packer *pk, const char *s) {
+  size_t room = pk->end - pk->p, len;
+
+  if (!s) s = "(null)";
+  if (room == 0) return -1;
+  len = strnlen(s, room - 1);
+  memcpy(pk->p, s, len);
+  pk->p[len] = '\0'; // a long string is cut short rather than dropped
+  pk->p += len + 1;
+  return 0;
+}
+
+static int pack_arg(struct packer *pk, const struct spec *s, va_list *ap) {
+  double d;
+  void *ptr;
+
+  if (s->star_width && pack_int(pk, va_arg(*ap, int)) < 0) return -1;
+  if (s->star_prec && pack_int(pk, va_arg(*ap, int)) < 0) return -1;
+
+  switch (s->conv) {
+  case 'd': case 'i':
+    switch (s->length) {
+    case LEN_L: return pack_int(pk, va_arg(*ap, long));
+    case LEN_LL: return pack_int(pk, va_arg(*ap, long long));
+    case LEN_Z: return pack_int(pk, va_arg(*ap, ptrdiff_t)); // ssize_t
+    case LEN_J: return pack_int(pk, va_arg(*ap, long long));
+    case LEN_T: return pack_int(pk, va_arg(*ap, ptrdiff_t));
+    default: return pack_int(pk, va_arg(*ap, int)); // hh and h are promoted
+    }
+  case 'u': case 'o': case 'x': case 'X':
+    switch (s->length) {
+    case LEN_L: return pack_int(pk, va_arg(*ap, unsigned long));
+    case LEN_LL: return pack_int(pk, va_arg(*ap, unsigned long long));
+    case LEN_Z: return pack_int(pk, va_arg(*ap, size_t));
+    case LEN_J: return pack_int(pk, va_arg(*ap, unsigned long long));
+    case LEN_T: return pack_int(pk, va_arg(*ap, ptrdiff_t));
+    default: return pack_int(pk, va_arg(*ap, unsigned int));
+    }
+  case 'c':
+    return pack_int(pk, va_arg(*ap, int));
+  case 's':
+    return pack_string(pk, va_arg(*ap, const char *));
+  case 'p':
+    ptr = va_arg(*ap, void *);
+    return pack(pk, &ptr, sizeof(ptr));
+  default:
+    if (!is_float(s->conv)) return -1; // %n and friends
+    d = s->length == LEN_BIG_L ? (double)va_arg(*ap, long double) : va_arg(*ap, double);
+    return pack(pk, &d, sizeof(d));
+  }
+}
+
+// Returns how many specs were packed, -1 if all of them
+static int pack_args(unsigned char *data, const char *fmt, va_list ap) {
+  struct packer pk = { data, data + LOG_RECORD_DATA };
+  struct spec s;
+  const char *p = fmt;
+  va_list aq;
+  int n = 0;
+
+  va_copy(aq, ap);
+  while ((p = strchr(p, '%'))) {
+    p = parse_spec(p + 1, &s);
+    if (s.conv == '%') continue;
+    if (pack_arg(&pk, &s, &aq) < 0) {
+      va_end(aq);
+      return n;
+    }
+    n++;
+  }
+  va_end(aq);
+
+  return -1;
+}
+
+// Formatting, on the flusher thread
+
+struct unpacker {
+  const unsigned char *p;
+};
+
+static long long unpack_int(struct unpacker *u) {
+  long long v;
+
+  memcpy(&v, u->p, sizeof(v));
+  u->p += sizeof(v);
+  return v;
+}
+
+// Steps over a value without formatting it
+static void skip_value(const struct spec *s, struct unpacker *u) {
+  switch (s->conv) {
+  case 's':
+    u->p += strlen((const char *)u->p) + 1;
+    break;
+  case 'p':
+    u->p += sizeof(void *);
+    break;
+  default:
+    u->p += is_float(s->conv) ? sizeof(double) : sizeof(long long);
+  }
+}
+
+static int format_arg(char *out, size_t size, const struct spec *s, struct unpacker *u) {
+  char f[32];
+  int star[2], nstar = 0, len = s->prefix_len;
+  long long i;
+  double d;
+  void *ptr;
+  const char *str;
+
+  if (s->star_width) star[nstar++] = unpack_int(u);
+  if (s->star_prec) star[nstar++] = unpack_int(u);
+  if (len > (int)sizeof(f) - 4) {
+    // too long to rebuild: print it as it was, the next specs still get
+    // their own values
+    skip_value(s, u);
+    return snprintf(out, size, "%.*s%c", len, s->start, s->conv);
+  }
+
+  // the same conversion, with a length modifier that fits what was packed
+  memcpy(f, s->start, len);
+
+#define EMIT(v) (nstar == 0 ? snprintf(out, size, f, v) : \
+                 nstar == 1 ? snprintf(out, size, f, star[0], v) : \
+                 snprintf(out, size, f, star[0], star[1], v))
+
+  switch (s->conv) {
+  case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+    i = unpack_int(u);
+    if (s->conv == 'c') {
+      f[len++] = 'c';
+      f[len] = '\0';
+      return EMIT((int)i);
+    }
+    f[len++] = 'l';
+    f[len++] = 'l';
+    f[len++] = s->conv;
+    f[len] = '\0';
+    // the unsigned conversions were packed zero-extended already
+    return EMIT(i);
+  case 's':
+    str = (const char *)u->p;
+    u->p += strlen(str) + 1;
+    f[len++] = 's';
+    f[len] = '\0';
+    return EMIT(str);
+  case 'p':
+    memcpy(&ptr, u->p, sizeof(ptr));
+    u->p += sizeof(ptr);
+    f[len++] = 'p';
+    f[len] = '\0';
+    return EMIT(ptr);
+  default:
+    memcpy(&d, u->p, sizeof(d));
+    u->p += sizeof(d);
+    f[len++] = s->conv;
+    f[len] = '\0';
+    return EMIT(d);
+  }
+#undef EMIT
+}
+
+// Appends the text of the record to out; returns the new length
+static size_t format_record(const struct log_record *rec, char *out, size_t len, size_t size) {
+  struct unpacker u = { rec->data };
+  struct spec s;
+  const char *p = rec->fmt, *pct;
+  int n = 0, w;
+
+  while (len < size - 1) {
+    pct = strchr(p, '%');
+    w = pct ? pct - p : (int)strlen(p);
+    if (w > (int)(size - 1 - len)) w = size - 1 - len;
+    memcpy(out + len, p, w);
+    len += w;
+    if (!pct) break;
+
+    p = parse_spec(pct + 1, &s);
+    if (s.conv == '%') {
+      out[len++] = '%';
+      continue;
+    }
+    if (rec->nspecs >= 0 && n == rec->nspecs) {
+      // the arguments did not fit in the record
+      w = snprintf(out + len, size - len, "...\n");
+      len += w < (int)(size - len) ? w : (int)(size - len - 1);
+      break;
+    }
+    w = format_arg(out + len, size - len, &s, &u);
+    if (w > 0) len += w < (int)(size - len) ? w : (int)(size - len - 1);
+    n++;
+  }
+
+  return len;
+}
+
+static void write_all(const char *buf, size_t len) {
+  ssize_t w;
+
+  while (len > 0) {
+    w = write(STDERR_FILENO, buf, len);
+    if (w <= 0) return;
+    buf += w;
+    len -= w;
+  }
+}
+
+// Everything that is in the ring now goes out in as few writes as possible
+static int drain() {
+  static char out[OUT_SIZE + 1024];
+  struct log_record *rec;
+  size_t len = 0;
+  int n = 0;
+
+  for (;;) {
+    rec = &ring[tail & RING_MASK];
+    if (atomic_load_explicit(&rec->seq, memory_order_acquire) != tail + 1) break;
+
+    len = format_record(rec, out, len, sizeof(out));
+    atomic_store_explicit(&rec->seq, tail + LOG_RING_SIZE, memory_order_release);
+    tail++;
+    n++;
+
+    if (len >= OUT_SIZE) {
+      write_all(out, len);
+      len = 0;
+    }
+  }
+  if (len) write_all(out, len);
+
+  return n;
+}
+
+static void *flusher_main(void *arg) {
+  uint64_t v;
+
+  for (;;) {
+    if (drain()) continue;
+    if (atomic_load(&quit)) return NULL;
+
+    // Tell the writers to wake us up, then look once more so a record that
+    // came in meanwhile is not left sitting there.
+    atomic_store(&sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst); // pairs with the one in wake_flusher()
+    if (drain()) {
+      atomic_store(&sleeping, 0);
+      continue;
+    }
+    if (read(wake_fd, &v, sizeof(v)) < 0) {
+      atomic_store(&sleeping, 0);
+      continue;
+    }
+  }
+}
+
+// Only a syscall when the flusher went to sleep, not once per message
+static void wake_flusher() {
+  uint64_t one = 1;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!atomic_load_explicit(&sleeping, memory_order_relaxed)) return;
+  if (atomic_exchange(&sleeping, 0) && write(wake_fd, &one, sizeof(one)) < 0) {
+    // can't happen short of 2^64 wakeups
+  }
+}
+
+static void log_fini() {
+  uint64_t one = 1;
+
+  if (!running) return;
+  atomic_store(&quit, 1);
+  if (write(wake_fd, &one, sizeof(one)) < 0) return;
+  pthread_join(thread, NULL);
+  running = 0;
+
+  if (atomic_load(&dropped)) fprintf(stderr, "log: %llu messages dropped\n", (unsigned long long)atomic_load(&dropped));
+}
+
+int log_init() {
+  size_t i;
+
+  if (running) return 0;
+
+  for (i = 0; i < LOG_RING_SIZE; i++) atomic_init(&ring[i].seq, i);
+
+  wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (wake_fd < 0) return -1;
+
+  if (pthread_create(&thread, NULL, flusher_main, NULL) != 0) {
+    close(wake_fd);
+    wake_fd = -1;
+    return -1;
+  }
+  running = 1;
+  atexit(log_fini);
+
+  return 0;
+}
+
+void log_write(int level, const char *fmt, ...) {
+  struct log_record *rec;
+  size_t pos, seq;
+  va_list ap;
+
+  if (!running) {
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
+  // claim a slot (several threads may log at once)
+  pos = atomic_load_explicit(&head, memory_order_relaxed);
+  for (;;) {
+    rec = &ring[pos & RING_MASK];
+    seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+    } else if ((ptrdiff_t)(seq - pos) < 0) {
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed); // full
+      return;
+    } else {
+      pos = atomic_load_explicit(&head, memory_order_relaxed);
+    }
+  }
+
+  rec->fmt = fmt;
+  rec->level = level;
+  va_start(ap, fmt);
+  rec->nspecs = pack_args(rec->data, fmt, ap);
+  va_end(ap);
+  atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+
+  wake_flusher();
+}
+
+uint64_t log_dropped() {
+  return atomic_load(&dropped);
+}
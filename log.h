@@ -0,0 +1,43 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// Logging that never stalls the caller. A log call only copies its format
+// pointer and arguments into a fixed-size binary record in a lock-free
+// ring; a background thread turns the records into text and writes them
+// out (to stderr). Formatting and the write(2) happen there, so a slow
+// terminal or a full log pipe can't hold up event dispatch. If the ring is
+// full the record is dropped and counted, rather than waiting.
+//
+// Messages below LOG_LEVEL are compiled out entirely, arguments included:
+//   $ gcc -DLOG_LEVEL=LOG_DEBUG ...
+//
+// The format must be a string literal (it is read later, on the other
+// thread). %s arguments are copied, so they may go away right after the
+// call. %n is not supported.
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+#define LOG_RING_SIZE 1024 // records, a power of two
+#define LOG_RECORD_DATA 200 // bytes of arguments per record
+
+#define log_at(level, ...) do { if ((level) <= LOG_LEVEL) log_write((level), __VA_ARGS__); } while (0)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+// Starts the flusher thread. Until then (or if it fails), log_write()
+// prints synchronously. Everything logged is written out at exit.
+int log_init();
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+uint64_t log_dropped();
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime.h"
+
+struct mime_source *mime_source_create() {
+  return calloc(1, sizeof(struct mime_source));
+}
+
+void mime_source_destroy(struct mime_source *s) {
+  int i;
+
+  if (!s) return;
+  for (i = 0; i < s->count; i++) {
+    free(s->entries[i].type);
+    payload_unref(s->entries[i].payload);
+  }
+  free(s);
+}
+
+static struct mime_entry *add(struct mime_source *s, const char *type) {
+  struct mime_entry *e;
+
+  if (s->count == MIME_MAX_TYPES) return NULL;
+
+  e = &s->entries[s->count];
+  memset(e, 0, sizeof(*e));
+  e->type = strdup(type);
+  if (!e->type) return NULL;
+
+  s->count++;
+  return e;
+}
+
+int mime_source_add(struct mime_source *s, const char *type, struct payload *p) {
+  struct mime_entry *e = add(s, type);
+
+  if (!e) return -1;
+  e->payload = payload_ref(p);
+  return 0;
+}
+
+int mime_source_add_converter(struct mime_source *s, const char *type, mime_convert_func convert, void *data) {
+  struct mime_entry *e = add(s, type);
+
+  if (!e) return -1;
+  e->convert = convert;
+  e->data = data;
+  return 0;
+}
+
+void mime_source_offer(struct mime_source *s, struct wl_data_source *source) {
+  int i;
+
+  for (i = 0; i < s->count; i++) wl_data_source_offer(source, s->entries[i].type);
+}
+
+struct payload *mime_source_get(struct mime_source *s, const char *type) {
+  struct mime_entry *e;
+  int i;
+
+  for (i = 0; i < s->count; i++) {
+    e = &s->entries[i];
+    if (strcmp(e->type, type) != 0) continue;
+
+    if (!e->payload && e->convert) {
+      e->payload = e->convert(type, e->data);
+      s->conversions++;
+    }
+    return e->payload;
+  }
+  return NULL;
+}
+
+struct mime_offer *mime_offer_create() {
+  return calloc(1, sizeof(struct mime_offer));
+}
+
+void mime_offer_destroy(struct mime_offer *o) {
+  int i;
+
+  if (!o) return;
+  for (i = 0; i < o->count; i++) free(o->types[i]);
+  free(o->types);
+  free(o);
+}
+
+void mime_offer_add(struct mime_offer *o, const char *type) {
+  char **types;
+  int capacity;
+
+  if (o->count == o->capacity) {
+    capacity = o->capacity ? o->capacity * 2 : 16;
+    types = realloc(o->types, capacity * sizeof(*types));
+    if (!types) return;
+    o->types = types;
+    o->capacity = capacity;
+  }
+
+  o->types[o->count] = strdup(type);
+  if (o->types[o->count]) o->count++;
+}
+
+const char *mime_offer_pick(const struct mime_offer *o, const char *const *wanted, int nwanted) {
+  int i, j;
+
+  if (!o) return NULL;
+  for (i = 0; i < nwanted; i++) {
+    for (j = 0; j < o->count; j++) {
+      if (strcmp(wanted[i], o->types[j]) == 0) return o->types[j];
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <wayland-client.h>
+
+#include "sender.h"
+
+// MIME types on both ends of a wl_data_offer.
+//
+// A mime_source is what we offer: one entry per type, backed either by a
+// payload or by a converter. A converter only runs when some client
+// actually asks for its type, and what it made is kept for the next
+// request, so pasting the same rich content again costs no conversion.
+//
+// A mime_offer records the types another client offers (one per
+// wl_data_offer, as its user data), so we can ask for the cheapest one we
+// understand. There can be any number of them: bridged X11 clients list
+// dozens of targets, plain text often last.
+#define MIME_MAX_TYPES 16 // of a mime_source
+
+// Makes the payload for `type`, or NULL
+typedef struct payload *(*mime_convert_func)(const char *type, void *data);
+
+struct mime_entry {
+  char *type;
+  struct payload *payload; // NULL until converted
+  mime_convert_func convert;
+  void *data;
+};
+
+struct mime_source {
+  struct mime_entry entries[MIME_MAX_TYPES];
+  int count;
+  int conversions; // converter runs so far
+};
+
+struct mime_source *mime_source_create();
+void mime_source_destroy(struct mime_source *s);
+// Takes a reference on `p`
+int mime_source_add(struct mime_source *s, const char *type, struct payload *p);
+int mime_source_add_converter(struct mime_source *s, const char *type, mime_convert_func convert, void *data);
+// wl_data_source.offer for every type, in the order they were added
+void mime_source_offer(struct mime_source *s, struct wl_data_source *source);
+// For wl_data_source.send. NULL if `type` isn't ours or didn't convert.
+struct payload *mime_source_get(struct mime_source *s, const char *type);
+
+struct mime_offer {
+  char **types;
+  int count, capacity;
+};
+
+struct mime_offer *mime_offer_create();
+void mime_offer_destroy(struct mime_offer *o);
+// wl_data_offer.offer
+void mime_offer_add(struct mime_offer *o, const char *type);
+// The first of `wanted` (cheapest first) that is on offer, or NULL
+const char *mime_offer_pick(const struct mime_offer *o, const char *const *wanted, int nwanted);
+
+#endif
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE // memfd_create
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "os_compat.h"
+
+// Dealing with tmpfiles
+int set_cloexec_or_close(int fd) {
+  long flags;
+  if (fd == -1) return -1;
+  
+  flags = fcntl(fd, F_GETFD);
+  if (flags == -1) {
+    close(fd);
+    return -1;
+  }
+
+  if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int create_tmpfile_cloexec(char *tmpname) {
+#ifdef HAVE_MKOSTEMP
+  int fd = mkostemp(tmpname, O_CLOEXEC);
+  if (fd >= 0) unlink(tmpname);
+#else
+  int fd = mkstemp(tmpname);
+  if (fd >= 0) {
+    fd = set_cloexec_or_close(fd);
+    unlink(tmpname);
+  }
+#endif
+
+  return fd;
+}
+
+// Reserve the blocks up front so the first touch of a page in the mapping
+// can't SIGBUS (or fault in a fresh block) in the middle of a paint.
+// Falls back to ftruncate on filesystems without fallocate support.
+int os_resize_anonymous_file(int fd, off_t size) {
+  int ret;
+
+#ifndef NO_POSIX_FALLOCATE
+  do {
+    ret = posix_fallocate(fd, 0, size);
+  } while (ret == EINTR);
+
+  if (ret == 0) return 0;
+  if (ret != EINVAL && ret != EOPNOTSUPP) {
+    errno = ret;
+    return -1;
+  }
+#endif
+
+  do {
+    ret = ftruncate(fd, size);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+static int create_tmpfile_in_runtime_dir() {
+  static const char template[] = "/weston-shared-XXXXXX";
+  const char *path;
+  char *name;
+  int fd;
+
+  path = getenv("XDG_RUNTIME_DIR");
+  if (!path) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  name = malloc(strlen(path) + sizeof(template));
+  if (!name) return -1;
+  strcpy(name, path);
+  strcat(name, template); // name += template
+
+  fd = create_tmpfile_cloexec(name);
+  free(name);
+  return fd;
+}
+
+int os_create_anonymous_file(off_t size) { // from Weston's implementation
+  int fd = -1;
+
+#ifdef MFD_CLOEXEC
+  // No path, no directory lookup and no unlink: one syscall for the file.
+  fd = memfd_create("weston-shared", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd >= 0) {
+    // The compositor maps this file too; never let it shrink under its feet.
+    // Growing stays allowed so that the shm pool can be resized.
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK);
+  }
+#endif
+
+  if (fd < 0) fd = create_tmpfile_in_runtime_dir(); // kernels without memfd
+  if (fd < 0) return -1;
+
+  if (os_resize_anonymous_file(fd, size) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// For files that will never change size again (a one-shot buffer etc.).
+// Only memfds can be sealed; for tmpfiles this is a no-op.
+int os_seal_anonymous_file(int fd) {
+#ifdef MFD_CLOEXEC
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 && errno != EINVAL) return -1;
+#endif
+  return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef OS_COMPAT_H
+#define OS_COMPAT_H
+
+#include <sys/types.h>
+
+int set_cloexec_or_close(int fd);
+int create_tmpfile_cloexec(char *tmpname);
+int os_create_anonymous_file(off_t size);
+int os_resize_anonymous_file(int fd, off_t size);
+int os_seal_anonymous_file(int fd);
+
+#endif
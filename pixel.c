@@ -0,0 +1,325 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PIXEL_NEON
+#endif
+
+#include "pixel.h"
+
+struct pixel_impl {
+  const char *name;
+  void (*fill)(uint32_t *dst, size_t n, uint32_t value, int nt);
+  void (*copy)(uint32_t *dst, const uint32_t *src, size_t n, int nt);
+  void (*blend)(uint32_t *dst, const uint32_t *src, size_t n);
+};
+
+// Plain C
+
+// dst * (255 - a) / 255 on two channels at once (the 0x00ff00ff trick)
+static inline uint32_t blend_pixel(uint32_t d, uint32_t s) {
+  uint32_t ia = 255 - (s >> 24);
+  uint32_t rb = (d & 0x00ff00ff) * ia + 0x00800080;
+  uint32_t ag = ((d >> 8) & 0x00ff00ff) * ia + 0x00800080;
+
+  rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+  ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+
+  return s + (rb | ag);
+}
+
+static void fill_c(uint32_t *dst, size_t n, uint32_t value, int nt) {
+  size_t i;
+
+  for (i = 0; i < n; i++) dst[i] = value;
+}
+
+static void copy_c(uint32_t *dst, const uint32_t *src, size_t n, int nt) {
+  memcpy(dst, src, n * 4);
+}
+
+static void blend_c(uint32_t *dst, const uint32_t *src, size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++) dst[i] = blend_pixel(dst[i], src[i]);
+}
+
+static const struct pixel_impl impl_c = { "c", fill_c, copy_c, blend_c };
+
+#ifdef PIXEL_X86
+
+// Scalar head until dst is aligned for the (streaming) vector stores.
+// Returns the number of pixels written.
+static inline size_t align_head(uint32_t *dst, size_t n, uint32_t value, size_t align) {
+  size_t i = 0;
+
+  while (i < n && ((uintptr_t)(dst + i) & (align - 1))) dst[i++] = value;
+  return i;
+}
+
+static inline size_t align_head_copy(uint32_t *dst, const uint32_t *src, size_t n, size_t align) {
+  size_t i = 0;
+
+  while (i < n && ((uintptr_t)(dst + i) & (align - 1))) {
+    dst[i] = src[i];
+    i++;
+  }
+  return i;
+}
+
+// SSE2
+
+__attribute__((target("sse2")))
+static void fill_sse2(uint32_t *dst, size_t n, uint32_t value, int nt) {
+  __m128i v = _mm_set1_epi32(value);
+  size_t i = align_head(dst, n, value, 16);
+
+  if (nt) {
+    for (; i + 4 <= n; i += 4) _mm_stream_si128((__m128i *)(dst + i), v);
+    _mm_sfence();
+  } else {
+    for (; i + 4 <= n; i += 4) _mm_store_si128((__m128i *)(dst + i), v);
+  }
+  for (; i < n; i++) dst[i] = value;
+}
+
+__attribute__((target("sse2")))
+static void copy_sse2(uint32_t *dst, const uint32_t *src, size_t n, int nt) {
+  size_t i;
+
+  if (!nt) {
+    memcpy(dst, src, n * 4); // libc already does this well
+    return;
+  }
+
+  i = align_head_copy(dst, src, n, 16);
+  for (; i + 4 <= n; i += 4) {
+    _mm_stream_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+  }
+  _mm_sfence();
+  for (; i < n; i++) dst[i] = src[i];
+}
+
+// 4 pixels: widen to 16 bits/channel, dst * (255 - a), divide by 255, add src
+__attribute__((target("sse2")))
+static inline __m128i blend4_sse2(__m128i d, __m128i s) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i c255 = _mm_set1_epi16(255), c128 = _mm_set1_epi16(128);
+  __m128i slo = _mm_unpacklo_epi8(s, zero), shi = _mm_unpackhi_epi8(s, zero);
+  __m128i dlo = _mm_unpacklo_epi8(d, zero), dhi = _mm_unpackhi_epi8(d, zero);
+  __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xff), 0xff);
+  __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xff), 0xff);
+
+  dlo = _mm_add_epi16(_mm_mullo_epi16(dlo, _mm_sub_epi16(c255, alo)), c128);
+  dhi = _mm_add_epi16(_mm_mullo_epi16(dhi, _mm_sub_epi16(c255, ahi)), c128);
+  dlo = _mm_srli_epi16(_mm_add_epi16(dlo, _mm_srli_epi16(dlo, 8)), 8);
+  dhi = _mm_srli_epi16(_mm_add_epi16(dhi, _mm_srli_epi16(dhi, 8)), 8);
+
+  return _mm_adds_epu8(s, _mm_packus_epi16(dlo, dhi));
+}
+
+__attribute__((target("sse2")))
+static void blend_sse2(uint32_t *dst, const uint32_t *src, size_t n) {
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), blend4_sse2(d, s));
+  }
+  for (; i < n; i++) dst[i] = blend_pixel(dst[i], src[i]);
+}
+
+static const struct pixel_impl impl_sse2 = { "sse2", fill_sse2, copy_sse2, blend_sse2 };
+
+// AVX2
+
+__attribute__((target("avx2")))
+static void fill_avx2(uint32_t *dst, size_t n, uint32_t value, int nt) {
+  __m256i v = _mm256_set1_epi32(value);
+  size_t i = align_head(dst, n, value, 32);
+
+  if (nt) {
+    for (; i + 8 <= n; i += 8) _mm256_stream_si256((__m256i *)(dst + i), v);
+    _mm_sfence();
+  } else {
+    for (; i + 8 <= n; i += 8) _mm256_store_si256((__m256i *)(dst + i), v);
+  }
+  for (; i < n; i++) dst[i] = value;
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(uint32_t *dst, const uint32_t *src, size_t n, int nt) {
+  size_t i;
+
+  if (!nt) {
+    memcpy(dst, src, n * 4);
+    return;
+  }
+
+  i = align_head_copy(dst, src, n, 32);
+  for (; i + 8 <= n; i += 8) {
+    _mm256_stream_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+  }
+  _mm_sfence();
+  for (; i < n; i++) dst[i] = src[i];
+}
+
+// Same as blend4_sse2() on 8 pixels. Unpack and pack both work per 128-bit
+// lane, so the pixel order comes out right.
+__attribute__((target("avx2")))
+static void blend_avx2(uint32_t *dst, const uint32_t *src, size_t n) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i c255 = _mm256_set1_epi16(255), c128 = _mm256_set1_epi16(128);
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i slo = _mm256_unpacklo_epi8(s, zero), shi = _mm256_unpackhi_epi8(s, zero);
+    __m256i dlo = _mm256_unpacklo_epi8(d, zero), dhi = _mm256_unpackhi_epi8(d, zero);
+    __m256i alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, 0xff), 0xff);
+    __m256i ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, 0xff), 0xff);
+
+    dlo = _mm256_add_epi16(_mm256_mullo_epi16(dlo, _mm256_sub_epi16(c255, alo)), c128);
+    dhi = _mm256_add_epi16(_mm256_mullo_epi16(dhi, _mm256_sub_epi16(c255, ahi)), c128);
+    dlo = _mm256_srli_epi16(_mm256_add_epi16(dlo, _mm256_srli_epi16(dlo, 8)), 8);
+    dhi = _mm256_srli_epi16(_mm256_add_epi16(dhi, _mm256_srli_epi16(dhi, 8)), 8);
+
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epu8(s, _mm256_packus_epi16(dlo, dhi)));
+  }
+  for (; i < n; i++) dst[i] = blend_pixel(dst[i], src[i]);
+}
+
+static const struct pixel_impl impl_avx2 = { "avx2", fill_avx2, copy_avx2, blend_avx2 };
+
+// AVX-512 (F only; blending stays on AVX2 since 16-bit lanes need BW)
+
+__attribute__((target("avx512f")))
+static void fill_avx512(uint32_t *dst, size_t n, uint32_t value, int nt) {
+  __m512i v = _mm512_set1_epi32(value);
+  size_t i = align_head(dst, n, value, 64);
+
+  if (nt) {
+    for (; i + 16 <= n; i += 16) _mm512_stream_si512((void *)(dst + i), v);
+    _mm_sfence();
+  } else {
+    for (; i + 16 <= n; i += 16) _mm512_store_si512((void *)(dst + i), v);
+  }
+  for (; i < n; i++) dst[i] = value;
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(uint32_t *dst, const uint32_t *src, size_t n, int nt) {
+  size_t i;
+
+  if (!nt) {
+    memcpy(dst, src, n * 4);
+    return;
+  }
+
+  i = align_head_copy(dst, src, n, 64);
+  for (; i + 16 <= n; i += 16) {
+    _mm512_stream_si512((void *)(dst + i), _mm512_loadu_si512((const void *)(src + i)));
+  }
+  _mm_sfence();
+  for (; i < n; i++) dst[i] = src[i];
+}
+
+static const struct pixel_impl impl_avx512 = { "avx512", fill_avx512, copy_avx512, blend_avx2 };
+
+#endif // PIXEL_X86
+
+#ifdef PIXEL_NEON
+
+// NEON has no non-temporal hint in the intrinsics, so nt is ignored.
+static void fill_neon(uint32_t *dst, size_t n, uint32_t value, int nt) {
+  uint32x4_t v = vdupq_n_u32(value);
+  size_t i;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    vst1q_u32(dst + i, v);
+    vst1q_u32(dst + i + 4, v);
+    vst1q_u32(dst + i + 8, v);
+    vst1q_u32(dst + i + 12, v);
+  }
+  for (; i < n; i++) dst[i] = value;
+}
+
+// x * ia / 255 (rounded) for 16 channels, widening to 16 bits on the way
+static inline uint8x16_t mul_div255_neon(uint8x16_t x, uint8x16_t ia) {
+  uint16x8_t lo = vmull_u8(vget_low_u8(x), vget_low_u8(ia));
+  uint16x8_t hi = vmull_u8(vget_high_u8(x), vget_high_u8(ia));
+
+  return vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)), vraddhn_u16(hi, vrshrq_n_u16(hi, 8)));
+}
+
+// 16 pixels at a time, deinterleaved into B, G, R and A planes
+static void blend_neon(uint32_t *dst, const uint32_t *src, size_t n) {
+  size_t i;
+  int c;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    uint8x16x4_t s = vld4q_u8((const uint8_t *)(src + i));
+    uint8x16x4_t d = vld4q_u8((const uint8_t *)(dst + i));
+    uint8x16_t ia = vmvnq_u8(s.val[3]);
+
+    for (c = 0; c < 4; c++) d.val[c] = vqaddq_u8(s.val[c], mul_div255_neon(d.val[c], ia));
+    vst4q_u8((uint8_t *)(dst + i), d);
+  }
+  for (; i < n; i++) dst[i] = blend_pixel(dst[i], src[i]);
+}
+
+static const struct pixel_impl impl_neon = { "neon", fill_neon, copy_c, blend_neon };
+
+#endif // PIXEL_NEON
+
+static const struct pixel_impl *impl = &impl_c;
+
+__attribute__((constructor))
+static void pixel_init() {
+#ifdef PIXEL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2")) impl = &impl_avx512;
+  else if (__builtin_cpu_supports("avx2")) impl = &impl_avx2;
+  else if (__builtin_cpu_supports("sse2")) impl = &impl_sse2;
+#elif defined(PIXEL_NEON)
+  impl = &impl_neon; // always there on aarch64 / when built with -mfpu=neon
+#endif
+}
+
+void pixel_fill(uint32_t *dst, size_t n, uint32_t value) {
+  impl->fill(dst, n, value, n * 4 >= PIXEL_NT_THRESHOLD);
+}
+
+void pixel_fill_rect(uint32_t *dst, int stride, int x, int y, int width, int height, uint32_t value) {
+  int nt = (size_t)width * height * 4 >= PIXEL_NT_THRESHOLD;
+  char *row = (char *)dst + (size_t)y * stride + (size_t)x * 4;
+  int j;
+
+  if (width <= 0 || height <= 0) return;
+
+  // contiguous rows: one long run instead of `height` short ones
+  if (x == 0 && width * 4 == stride) {
+    impl->fill((uint32_t *)row, (size_t)width * height, value, nt);
+    return;
+  }
+
+  for (j = 0; j < height; j++, row += stride) impl->fill((uint32_t *)row, width, value, nt);
+}
+
+void pixel_copy_row(uint32_t *dst, const uint32_t *src, size_t n) {
+  impl->copy(dst, src, n, n * 4 >= PIXEL_NT_THRESHOLD);
+}
+
+void pixel_blend_row(uint32_t *dst, const uint32_t *src, size_t n) {
+  impl->blend(dst, src, n);
+}
+
+const char *pixel_impl_name() {
+  return impl->name;
+}
@@ -0,0 +1,24 @@
+#ifndef PIXEL_H
+#define PIXEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Pixel kernels for 32bpp (A/X)RGB8888 buffers. The best implementation for
+// the running CPU (AVX-512 / AVX2 / SSE2 / NEON / plain C) is picked once at
+// startup. Strides are in bytes, as in wl_shm.
+
+// Writes of at least this many bytes bypass the cache with non-temporal
+// stores: a full-surface fill into a shm buffer is read by the compositor,
+// not by us, so there is no point in evicting our own working set for it.
+#define PIXEL_NT_THRESHOLD (256 * 1024)
+
+void pixel_fill(uint32_t *dst, size_t n, uint32_t value);
+void pixel_fill_rect(uint32_t *dst, int stride, int x, int y, int width, int height, uint32_t value);
+void pixel_copy_row(uint32_t *dst, const uint32_t *src, size_t n);
+// Porter-Duff OVER with premultiplied alpha: dst = src + dst * (1 - src.a)
+void pixel_blend_row(uint32_t *dst, const uint32_t *src, size_t n);
+
+const char *pixel_impl_name();
+
+#endif
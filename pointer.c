@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wayland-client.h>
+
+#include "pointer.h"
+
+static void deliver(struct pointer_frames *p) {
+  struct pointer_event ev;
+
+  if (p->pending.mask == 0) return;
+
+  // reset first: the handler may well end up flushing again
+  ev = p->pending;
+  memset(&p->pending, 0, sizeof(p->pending));
+  p->pending.x = ev.x;
+  p->pending.y = ev.y;
+
+  p->func(p->data, &ev);
+}
+
+static int holdable(const struct pointer_event *ev) {
+  return !(ev->mask & (POINTER_ENTER | POINTER_LEAVE | POINTER_BUTTON));
+}
+
+static void frame(void *data, struct wl_pointer *ptr) {
+  struct pointer_frames *p = data;
+
+  if (p->per_display_frame && holdable(&p->pending)) return;
+  deliver(p);
+}
+
+// Before wl_pointer v5 there are no frame events to wait for
+static void end_event(struct pointer_frames *p) {
+  if (wl_pointer_get_version(p->pointer) < WL_POINTER_FRAME_SINCE_VERSION) frame(p, p->pointer);
+}
+
+static void pointer_enter(void *data, struct wl_pointer *ptr, uint32_t serial, struct wl_surface *sfc, wl_fixed_t sfc_x, wl_fixed_t sfc_y) {
+  struct pointer_frames *p = data;
+
+  // a leave and an enter may share a frame (moving between two of our
+  // surfaces); the handler has to see the leave first
+  if (p->pending.mask & POINTER_LEAVE) deliver(p);
+
+  p->pending.mask |= POINTER_ENTER;
+  p->pending.serial = serial;
+  p->pending.surface = sfc;
+  p->pending.x = sfc_x;
+  p->pending.y = sfc_y;
+  end_event(p);
+}
+
+static void pointer_leave(void *data, struct wl_pointer *ptr, uint32_t serial, struct wl_surface *sfc) {
+  struct pointer_frames *p = data;
+
+  p->pending.mask |= POINTER_LEAVE;
+  p->pending.serial = serial;
+  end_event(p);
+}
+
+static void motion(void *data, struct wl_pointer *ptr, uint32_t time, wl_fixed_t sfc_x, wl_fixed_t sfc_y) {
+  struct pointer_frames *p = data;
+
+  p->pending.mask |= POINTER_MOTION;
+  p->pending.time = time;
+  p->pending.x = sfc_x;
+  p->pending.y = sfc_y;
+  end_event(p);
+}
+
+static void button(void *data, struct wl_pointer *ptr, uint32_t serial, uint32_t time, uint32_t button, uint32_t state) {
+  struct pointer_frames *p = data;
+
+  // Can't happen with a sane compositor, but a button must never be lost.
+  if (p->pending.nbuttons == POINTER_MAX_BUTTONS) deliver(p);
+
+  p->pending.mask |= POINTER_BUTTON;
+  p->pending.buttons[p->pending.nbuttons++] = (struct pointer_button){ serial, time, button, state };
+  end_event(p);
+}
+
+static void axis(void *data, struct wl_pointer *ptr, uint32_t time, uint32_t axis, wl_fixed_t value) {
+  struct pointer_frames *p = data;
+
+  if (axis > 1) return;
+  p->pending.mask |= POINTER_AXIS;
+  p->pending.time = time;
+  p->pending.axis[axis] += value;
+  end_event(p);
+}
+
+static void axis_source(void *data, struct wl_pointer *ptr, uint32_t axis_source) {
+  struct pointer_frames *p = data;
+
+  p->pending.mask |= POINTER_AXIS_SOURCE;
+  p->pending.axis_source = axis_source;
+}
+
+static void axis_stop(void *data, struct wl_pointer *ptr, uint32_t time, uint32_t axis) {
+  struct pointer_frames *p = data;
+
+  if (axis > 1) return;
+  p->pending.mask |= POINTER_AXIS_STOP;
+  p->pending.time = time;
+  p->pending.axis_stop |= 1 << axis;
+}
+
+static void axis_discrete(void *data, struct wl_pointer *ptr, uint32_t axis, int32_t discrete) {
+  struct pointer_frames *p = data;
+
+  if (axis > 1) return;
+  p->pending.mask |= POINTER_AXIS;
+  p->pending.discrete[axis] += discrete;
+}
+
+static const struct wl_pointer_listener pointer_listener = {
+  .enter = pointer_enter,
+  .leave = pointer_leave,
+  .motion = motion,
+  .button = button,
+  .axis = axis,
+  .frame = frame,
+  .axis_source = axis_source,
+  .axis_stop = axis_stop,
+  .axis_discrete = axis_discrete
+};
+
+struct pointer_frames *pointer_frames_create(struct wl_pointer *pointer, pointer_frame_func func, void *data) {
+  struct pointer_frames *p = calloc(1, sizeof(*p));
+
+  if (!p) return NULL;
+
+  p->pointer = pointer;
+  p->func = func;
+  p->data = data;
+  wl_pointer_add_listener(pointer, &pointer_listener, p);
+
+  return p;
+}
+
+void pointer_frames_destroy(struct pointer_frames *p) {
+  free(p);
+}
+
+void pointer_frames_flush(struct pointer_frames *p) {
+  deliver(p);
+}
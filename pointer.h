@@ -0,0 +1,66 @@
+#ifndef POINTER_H
+#define POINTER_H
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+// Collects the wl_pointer events of one wl_pointer.frame and hands them
+// over as a single logical event: the latest position, the axis motion
+// summed up, and the buttons in the order they came. A 1000Hz mouse then
+// costs one hit test and one cursor update per frame instead of one per
+// raw event.
+//
+// With `per_display_frame` set, frames that carry nothing but motion and
+// scrolling are held back and merged further until pointer_frames_flush()
+// (call it when a new frame of ours starts). Enter, leave and buttons are
+// never held: they carry serials the compositor wants to see used soon.
+//
+// wl_pointer before version 5 has no frame event; every event is a frame
+// of its own then.
+#define POINTER_MAX_BUTTONS 8
+
+#define POINTER_ENTER       (1 << 0)
+#define POINTER_LEAVE       (1 << 1)
+#define POINTER_MOTION      (1 << 2)
+#define POINTER_BUTTON      (1 << 3)
+#define POINTER_AXIS        (1 << 4)
+#define POINTER_AXIS_SOURCE (1 << 5)
+#define POINTER_AXIS_STOP   (1 << 6)
+
+struct pointer_button {
+  uint32_t serial, time, button, state;
+};
+
+struct pointer_event {
+  uint32_t mask;
+  uint32_t time;     // of the latest motion or axis event
+  uint32_t serial;   // of the enter or leave
+  struct wl_surface *surface; // entered
+  wl_fixed_t x, y;   // surface-local, also set by enter
+
+  struct pointer_button buttons[POINTER_MAX_BUTTONS];
+  int nbuttons;
+
+  // indexed by wl_pointer_axis
+  wl_fixed_t axis[2];
+  int32_t discrete[2];
+  uint32_t axis_source;
+  uint32_t axis_stop;   // bit per axis
+};
+
+typedef void (*pointer_frame_func)(void *data, const struct pointer_event *ev);
+
+struct pointer_frames {
+  struct wl_pointer *pointer;
+  pointer_frame_func func;
+  void *data;
+  int per_display_frame;
+
+  struct pointer_event pending; // x and y carry over between frames
+};
+
+struct pointer_frames *pointer_frames_create(struct wl_pointer *pointer, pointer_frame_func func, void *data);
+void pointer_frames_destroy(struct pointer_frames *p);
+void pointer_frames_flush(struct pointer_frames *p);
+
+#endif
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "raster.h"
+
+struct raster_worker {
+  struct raster *raster;
+  pthread_t thread;
+  int id;
+
+  // the run of tiles this worker starts with; thieves take from it too
+  atomic_int next;
+  int end;
+};
+
+struct raster {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;  // a new job is there
+  pthread_cond_t idle;  // a worker left the job
+  unsigned generation;
+  int active;
+  int quit;
+
+  int nthreads;
+  struct raster_worker workers[RASTER_MAX_THREADS];
+
+  // the current job
+  struct box *tiles;
+  int ntiles, capacity;
+  atomic_int remaining;
+  raster_tile_func func;
+  void *data;
+
+  int fd; // eventfd, bumped when the last tile of a job is done
+};
+
+static void job_done(struct raster *r) {
+  uint64_t one = 1;
+
+  if (write(r->fd, &one, sizeof(one)) < 0) perror("raster: could not signal the end of a job");
+}
+
+// Own run first, then steal from the neighbours in turn.
+static void run_tiles(struct raster *r, int self) {
+  struct raster_worker *victim;
+  int i, t;
+
+  for (i = 0; i < r->nthreads; i++) {
+    victim = &r->workers[(self + i) % r->nthreads];
+    while ((t = atomic_fetch_add(&victim->next, 1)) < victim->end) {
+      r->func(r->data, &r->tiles[t]);
+      if (atomic_fetch_sub(&r->remaining, 1) == 1) job_done(r);
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  struct raster_worker *w = arg;
+  struct raster *r = w->raster;
+  unsigned seen = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&r->lock);
+    while (r->generation == seen && !r->quit) pthread_cond_wait(&r->wake, &r->lock);
+    if (r->quit) {
+      pthread_mutex_unlock(&r->lock);
+      return NULL;
+    }
+    seen = r->generation;
+    r->active++;
+    pthread_mutex_unlock(&r->lock);
+
+    run_tiles(r, w->id);
+
+    pthread_mutex_lock(&r->lock);
+    if (--r->active == 0) pthread_cond_signal(&r->idle);
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+struct raster *raster_create(int nthreads) {
+  struct raster *r;
+  int i;
+
+  if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0) nthreads = 1;
+  if (nthreads > RASTER_MAX_THREADS) nthreads = RASTER_MAX_THREADS;
+
+  r = calloc(1, sizeof(*r));
+  if (!r) return NULL;
+
+  r->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (r->fd < 0) {
+    free(r);
+    return NULL;
+  }
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->wake, NULL);
+  pthread_cond_init(&r->idle, NULL);
+
+  for (i = 0; i < nthreads; i++) {
+    r->workers[i].raster = r;
+    r->workers[i].id = i;
+    if (pthread_create(&r->workers[i].thread, NULL, worker_main, &r->workers[i]) != 0) break;
+  }
+  r->nthreads = i;
+
+  if (r->nthreads == 0) {
+    raster_destroy(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+void raster_destroy(struct raster *r) {
+  int i;
+
+  if (!r) return;
+
+  pthread_mutex_lock(&r->lock);
+  r->quit = 1;
+  pthread_cond_broadcast(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+  for (i = 0; i < r->nthreads; i++) pthread_join(r->workers[i].thread, NULL);
+
+  pthread_cond_destroy(&r->idle);
+  pthread_cond_destroy(&r->wake);
+  pthread_mutex_destroy(&r->lock);
+  close(r->fd);
+  free(r->tiles);
+  free(r);
+}
+
+static int add_tile(struct raster *r, int x1, int y1, int x2, int y2) {
+  struct box *tiles;
+  int capacity;
+
+  if (r->ntiles == r->capacity) {
+    capacity = r->capacity ? r->capacity * 2 : 64;
+    tiles = realloc(r->tiles, capacity * sizeof(*tiles));
+    if (!tiles) return -1;
+    r->tiles = tiles;
+    r->capacity = capacity;
+  }
+
+  r->tiles[r->ntiles++] = (struct box){ x1, y1, x2, y2 };
+  return 0;
+}
+
+// Cut the boxes along the tile grid. Using a global grid (rather than
+// starting at each box's corner) keeps a tile within the same cache lines
+// no matter how the damage was split.
+static int build_tiles(struct raster *r, const struct box *boxes, int nboxes) {
+  const struct box *b;
+  int i, x, y, x2, y2;
+
+  r->ntiles = 0;
+  for (i = 0; i < nboxes; i++) {
+    b = &boxes[i];
+    for (y = b->y1 - b->y1 % RASTER_TILE_SIZE; y < b->y2; y += RASTER_TILE_SIZE) {
+      y2 = y + RASTER_TILE_SIZE < b->y2 ? y + RASTER_TILE_SIZE : b->y2;
+      for (x = b->x1 - b->x1 % RASTER_TILE_SIZE; x < b->x2; x += RASTER_TILE_SIZE) {
+        x2 = x + RASTER_TILE_SIZE < b->x2 ? x + RASTER_TILE_SIZE : b->x2;
+        if (add_tile(r, x > b->x1 ? x : b->x1, y > b->y1 ? y : b->y1, x2, y2) < 0) return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Only one job is in flight at a time: don't submit before the previous
+// one has been collected with raster_finish() or raster_wait().
+int raster_submit(struct raster *r, const struct box *boxes, int nboxes, raster_tile_func func, void *data) {
+  int i, per;
+
+  pthread_mutex_lock(&r->lock);
+  while (r->active) pthread_cond_wait(&r->idle, &r->lock); // stragglers of the previous job
+
+  if (build_tiles(r, boxes, nboxes) < 0) {
+    pthread_mutex_unlock(&r->lock);
+    return -1;
+  }
+  r->func = func;
+  r->data = data;
+  atomic_store(&r->remaining, r->ntiles);
+
+  if (r->ntiles <= RASTER_INLINE_TILES) {
+    for (i = 0; i < r->nthreads; i++) {
+      r->workers[i].end = 0;
+      atomic_store(&r->workers[i].next, 0);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    for (i = 0; i < r->ntiles; i++) func(data, &r->tiles[i]);
+    job_done(r);
+    return 0;
+  }
+
+  per = (r->ntiles + r->nthreads - 1) / r->nthreads;
+  for (i = 0; i < r->nthreads; i++) {
+    r->workers[i].end = (i + 1) * per < r->ntiles ? (i + 1) * per : r->ntiles;
+    atomic_store(&r->workers[i].next, i * per < r->ntiles ? i * per : r->ntiles);
+  }
+
+  r->generation++;
+  pthread_cond_broadcast(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+
+  return 0;
+}
+
+int raster_get_fd(struct raster *r) {
+  return r->fd;
+}
+
+int raster_finish(struct raster *r) {
+  uint64_t count;
+
+  return read(r->fd, &count, sizeof(count)) == sizeof(count);
+}
+
+void raster_wait(struct raster *r) {
+  struct pollfd pfd = { r->fd, POLLIN, 0 };
+
+  run_tiles(r, 0);
+  while (!raster_finish(r)) poll(&pfd, 1, -1);
+}
@@ -0,0 +1,30 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "region.h"
+
+// Paints damaged boxes on a pool of worker threads. Every box is cut into
+// RASTER_TILE_SIZE tiles aligned to a global grid, each worker starts on
+// its own contiguous run of tiles and steals from the others once it runs
+// dry. A job runs asynchronously: raster_get_fd() becomes readable when the
+// last tile is done, so the dispatch thread can keep handling events in the
+// meantime and commit the frame when it gets there.
+#define RASTER_TILE_SIZE 64
+#define RASTER_MAX_THREADS 32
+// Jobs this small are painted on the calling thread; waking the workers
+// would cost more than the painting.
+#define RASTER_INLINE_TILES 2
+
+// Called once per tile, from any thread. Tiles never overlap.
+typedef void (*raster_tile_func)(void *data, const struct box *tile);
+
+struct raster;
+
+struct raster *raster_create(int nthreads); // 0: one per online CPU
+void raster_destroy(struct raster *r);
+int raster_submit(struct raster *r, const struct box *boxes, int nboxes, raster_tile_func func, void *data);
+int raster_get_fd(struct raster *r);
+int raster_finish(struct raster *r); // 1 if the job completed, after the fd polled readable
+void raster_wait(struct raster *r);  // help out and block until the job is done
+
+#endif
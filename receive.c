@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "receive.h"
+#include "os_compat.h"
+
+void receive_init(struct receive *r, size_t spill_threshold) {
+  memset(r, 0, sizeof(*r));
+  r->spill_threshold = spill_threshold;
+  r->spill_fd = -1;
+}
+
+void receive_fini(struct receive *r) {
+  receive_reset(r);
+  free(r->data);
+  r->data = NULL;
+  r->capacity = 0;
+}
+
+void receive_reset(struct receive *r) {
+  if (r->spilled) close(r->spill_fd);
+  r->spilled = 0;
+  r->spill_fd = -1;
+  r->len = 0;
+}
+
+static int write_all(int fd, const char *p, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// From now on the payload lives in a memfd
+static int spill(struct receive *r) {
+  int fd = os_create_anonymous_file(0);
+
+  if (fd < 0) return -1;
+  if (write_all(fd, r->data, r->len) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  free(r->data);
+  r->data = NULL;
+  r->capacity = 0;
+  r->spill_fd = fd;
+  r->spilled = 1;
+  return 0;
+}
+
+static int grow(struct receive *r) {
+  size_t capacity = r->capacity ? r->capacity * 2 : RECEIVE_CHUNK;
+  char *data = realloc(r->data, capacity);
+
+  if (!data) return -1;
+  r->data = data;
+  r->capacity = capacity;
+  return 0;
+}
+
+// One chunk into the memfd; the pipe pages move over without a copy when
+// the kernel can
+static ssize_t read_spilled(struct receive *r, int fd) {
+  char buf[RECEIVE_CHUNK];
+  ssize_t n;
+
+  n = splice(fd, NULL, r->spill_fd, NULL, RECEIVE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n >= 0 || (errno != EINVAL && errno != ENOSYS)) return n;
+
+  n = read(fd, buf, sizeof(buf));
+  if (n > 0 && write_all(r->spill_fd, buf, n) < 0) return -1;
+  return n;
+}
+
+int receive_read(struct receive *r, int fd) {
+  ssize_t n;
+
+  for (;;) {
+    if (!r->spilled) {
+      if (r->spill_threshold && r->len >= r->spill_threshold && spill(r) < 0) return -1;
+    }
+
+    if (r->spilled) {
+      n = read_spilled(r, fd);
+    } else {
+      if (r->capacity - r->len < RECEIVE_CHUNK && grow(r) < 0) return -1;
+      n = read(fd, r->data + r->len, r->capacity - r->len);
+    }
+
+    if (n == 0) return 1;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN ? 0 : -1;
+    }
+    r->len += n;
+  }
+}
+
+const char *receive_map(struct receive *r) {
+  void *p;
+
+  if (r->len == 0) return "";
+  if (!r->spilled) return r->data;
+
+  p = mmap(NULL, r->len, PROT_READ, MAP_PRIVATE, r->spill_fd, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+void receive_unmap(struct receive *r, const char *data) {
+  if (r->spilled && r->len > 0 && data) munmap((void *)data, r->len);
+}
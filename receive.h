@@ -0,0 +1,36 @@
+#ifndef RECEIVE_H
+#define RECEIVE_H
+
+#include <stddef.h>
+
+// Collects what comes out of a pipe (a wl_data_offer.receive): reads as
+// much as the pipe has, in large chunks, straight into a buffer that
+// doubles as it fills up. The length is kept, so the payload may be
+// anything, NULs included.
+//
+// Past `spill_threshold` bytes the payload moves to a memfd and the rest
+// of the transfer is spliced into it, so a huge paste doesn't sit in our
+// heap. receive_map() gives the payload back either way.
+#define RECEIVE_CHUNK 65536
+#define RECEIVE_DEFAULT_SPILL (4 << 20)
+
+struct receive {
+  char *data; // NULL once spilled
+  size_t len, capacity;
+  size_t spill_threshold; // 0: never spill
+
+  int spilled;
+  int spill_fd;
+};
+
+void receive_init(struct receive *r, size_t spill_threshold);
+void receive_fini(struct receive *r);
+// Drops the payload, for the next transfer
+void receive_reset(struct receive *r);
+// `fd` should be non-blocking. 1: end of file, 0: wait for more, -1: error
+int receive_read(struct receive *r, int fd);
+// The whole payload (r->len bytes); hand it back with receive_unmap()
+const char *receive_map(struct receive *r);
+void receive_unmap(struct receive *r, const char *data);
+
+#endif
@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "region.h"
+
+// Which (in a, in b) combinations end up in the result, indexed by
+// in_a | in_b << 1.
+#define OP_UNION     0xe // a only, b only, both
+#define OP_INTERSECT 0x8 // both
+#define OP_SUBTRACT  0x2 // a only
+
+void region_init(struct region *r) {
+  memset(r, 0, sizeof(*r));
+}
+
+void region_init_rect(struct region *r, int x, int y, int width, int height) {
+  region_init(r);
+  if (width <= 0 || height <= 0) return;
+
+  r->extents.x1 = x;
+  r->extents.y1 = y;
+  r->extents.x2 = x + width;
+  r->extents.y2 = y + height;
+  r->n = 1;
+}
+
+void region_fini(struct region *r) {
+  free(r->boxes);
+  region_init(r);
+}
+
+void region_clear(struct region *r) {
+  memset(&r->extents, 0, sizeof(r->extents));
+  r->n = 0; // keep the storage for the next round
+}
+
+int region_empty(const struct region *r) {
+  return r->n == 0;
+}
+
+const struct box *region_boxes(const struct region *r, int *n) {
+  *n = r->n;
+  return r->n == 1 ? &r->extents : r->boxes;
+}
+
+static int reserve(struct region *r, int n) {
+  struct box *boxes;
+  int capacity;
+
+  if (n <= r->capacity) return 0;
+
+  capacity = r->capacity ? r->capacity : 8;
+  while (capacity < n) capacity *= 2;
+
+  boxes = realloc(r->boxes, capacity * sizeof(*boxes));
+  if (!boxes) return -1;
+
+  r->boxes = boxes;
+  r->capacity = capacity;
+  return 0;
+}
+
+int region_copy(struct region *dst, const struct region *src) {
+  if (dst == src) return 0;
+
+  if (src->n > 1) {
+    if (reserve(dst, src->n) < 0) return -1;
+    memcpy(dst->boxes, src->boxes, src->n * sizeof(*src->boxes));
+  }
+  dst->extents = src->extents;
+  dst->n = src->n;
+  return 0;
+}
+
+static int overlaps(const struct box *a, const struct box *b) {
+  return a->x1 < b->x2 && b->x1 < a->x2 && a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+static int contains(const struct box *a, const struct box *b) {
+  return a->x1 <= b->x1 && a->y1 <= b->y1 && b->x2 <= a->x2 && b->y2 <= a->y2;
+}
+
+static int compare_int(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Boxes of the band that covers [y, ...), starting the search at *i.
+// Since y is one of the breakpoints, such a band covers the whole
+// [y, next breakpoint) strip.
+static int band_at(const struct box *boxes, int n, int *i, int y) {
+  int start, end;
+
+  while (*i < n && boxes[*i].y2 <= y) (*i)++;
+  start = *i;
+  if (start == n || boxes[start].y1 > y) return 0;
+
+  for (end = start; end < n && boxes[end].y1 == boxes[start].y1; end++);
+  return end - start;
+}
+
+// Append one span of the current band, merging it into the previous one
+// when they touch.
+static int emit(struct region *out, int band_start, int x1, int x2, int y1, int y2) {
+  struct box *last = out->n > band_start ? &out->boxes[out->n - 1] : NULL;
+
+  if (last && last->x2 == x1) {
+    last->x2 = x2;
+    return 0;
+  }
+
+  if (reserve(out, out->n + 1) < 0) return -1;
+  out->boxes[out->n++] = (struct box){ x1, y1, x2, y2 };
+  return 0;
+}
+
+// If this band has exactly the same spans as the one right above it, grow
+// that one instead. Returns the new start of the last band.
+static int coalesce(struct region *out, int prev_start, int band_start) {
+  int prev_n = band_start - prev_start, n = out->n - band_start, i;
+
+  if (prev_start < 0 || prev_n != n || n == 0) return band_start;
+  if (out->boxes[prev_start].y2 != out->boxes[band_start].y1) return band_start;
+
+  for (i = 0; i < n; i++) {
+    if (out->boxes[prev_start + i].x1 != out->boxes[band_start + i].x1 ||
+        out->boxes[prev_start + i].x2 != out->boxes[band_start + i].x2) return band_start;
+  }
+
+  for (i = 0; i < n; i++) out->boxes[prev_start + i].y2 = out->boxes[band_start + i].y2;
+  out->n = band_start;
+  return prev_start;
+}
+
+static void update_extents(struct region *r) {
+  int i;
+
+  if (r->n == 0) {
+    memset(&r->extents, 0, sizeof(r->extents));
+    return;
+  }
+
+  r->extents.x1 = INT_MAX;
+  r->extents.x2 = INT_MIN;
+  r->extents.y1 = r->boxes[0].y1;
+  r->extents.y2 = r->boxes[r->n - 1].y2;
+  for (i = 0; i < r->n; i++) {
+    if (r->boxes[i].x1 < r->extents.x1) r->extents.x1 = r->boxes[i].x1;
+    if (r->boxes[i].x2 > r->extents.x2) r->extents.x2 = r->boxes[i].x2;
+  }
+}
+
+// The general case: cut both regions into the strips between every y edge
+// of either, combine the spans of each strip with a sweep over x and glue
+// identical strips back together.
+static int region_op(struct region *dst, const struct region *a, const struct region *b, int op) {
+  const struct box *ba, *bb;
+  struct region out;
+  int na, nb, ny = 0, k, i, j, ia = 0, ib = 0;
+  int *ys, prev_start = -1, band_start;
+
+  ba = region_boxes(a, &na);
+  bb = region_boxes(b, &nb);
+
+  ys = malloc(2 * (na + nb) * sizeof(*ys));
+  if (!ys) return -1;
+  for (i = 0; i < na; i++) {
+    ys[ny++] = ba[i].y1;
+    ys[ny++] = ba[i].y2;
+  }
+  for (i = 0; i < nb; i++) {
+    ys[ny++] = bb[i].y1;
+    ys[ny++] = bb[i].y2;
+  }
+  qsort(ys, ny, sizeof(*ys), compare_int);
+  for (i = 0, j = 0; i < ny; i++) {
+    if (j == 0 || ys[j - 1] != ys[i]) ys[j++] = ys[i];
+  }
+  ny = j;
+
+  region_init(&out);
+  for (k = 0; k + 1 < ny; k++) {
+    int y1 = ys[k], y2 = ys[k + 1];
+    int ka = band_at(ba, na, &ia, y1), kb = band_at(bb, nb, &ib, y1);
+    const struct box *sa = ba + ia, *sb = bb + ib;
+    int in_a = 0, in_b = 0, x = INT_MIN, nx;
+
+    band_start = out.n;
+    i = j = 0;
+    for (;;) {
+      int xa = i < ka ? (in_a ? sa[i].x2 : sa[i].x1) : INT_MAX;
+      int xb = j < kb ? (in_b ? sb[j].x2 : sb[j].x1) : INT_MAX;
+
+      nx = xa < xb ? xa : xb;
+      if (nx == INT_MAX) break;
+
+      if (x < nx && (op >> (in_a | in_b << 1)) & 1) {
+        if (emit(&out, band_start, x, nx, y1, y2) < 0) goto oom;
+      }
+      x = nx;
+
+      if (xa == nx) {
+        if (in_a) i++;
+        in_a = !in_a;
+      }
+      if (xb == nx) {
+        if (in_b) j++;
+        in_b = !in_b;
+      }
+    }
+
+    prev_start = coalesce(&out, prev_start, band_start);
+    if (out.n == band_start) prev_start = -1; // an empty strip breaks the chain
+  }
+  free(ys);
+
+  update_extents(&out);
+  free(dst->boxes);
+  *dst = out;
+  return 0;
+
+oom:
+  free(ys);
+  region_fini(&out);
+  return -1;
+}
+
+int region_union(struct region *dst, const struct region *a, const struct region *b) {
+  if (b->n == 0) return region_copy(dst, a);
+  if (a->n == 0) return region_copy(dst, b);
+  if (a->n == 1 && contains(&a->extents, &b->extents)) return region_copy(dst, a);
+  if (b->n == 1 && contains(&b->extents, &a->extents)) return region_copy(dst, b);
+
+  return region_op(dst, a, b, OP_UNION);
+}
+
+int region_union_rect(struct region *dst, const struct region *src, int x, int y, int width, int height) {
+  struct region r;
+
+  region_init_rect(&r, x, y, width, height);
+  return region_union(dst, src, &r);
+}
+
+int region_intersect(struct region *dst, const struct region *a, const struct region *b) {
+  struct box *e;
+
+  if (a->n == 0 || b->n == 0 || !overlaps(&a->extents, &b->extents)) {
+    region_clear(dst);
+    return 0;
+  }
+
+  if (a->n == 1 && b->n == 1) {
+    e = &dst->extents;
+    e->x1 = a->extents.x1 > b->extents.x1 ? a->extents.x1 : b->extents.x1;
+    e->y1 = a->extents.y1 > b->extents.y1 ? a->extents.y1 : b->extents.y1;
+    e->x2 = a->extents.x2 < b->extents.x2 ? a->extents.x2 : b->extents.x2;
+    e->y2 = a->extents.y2 < b->extents.y2 ? a->extents.y2 : b->extents.y2;
+    dst->n = 1;
+    return 0;
+  }
+
+  if (a->n == 1 && contains(&a->extents, &b->extents)) return region_copy(dst, b);
+  if (b->n == 1 && contains(&b->extents, &a->extents)) return region_copy(dst, a);
+
+  return region_op(dst, a, b, OP_INTERSECT);
+}
+
+int region_intersect_rect(struct region *dst, const struct region *src, int x, int y, int width, int height) {
+  struct region r;
+
+  region_init_rect(&r, x, y, width, height);
+  return region_intersect(dst, src, &r);
+}
+
+int region_subtract(struct region *dst, const struct region *a, const struct region *b) {
+  if (a->n == 0 || b->n == 0 || !overlaps(&a->extents, &b->extents)) return region_copy(dst, a);
+  if (b->n == 1 && contains(&b->extents, &a->extents)) {
+    region_clear(dst);
+    return 0;
+  }
+
+  return region_op(dst, a, b, OP_SUBTRACT);
+}
+
+void region_translate(struct region *r, int dx, int dy) {
+  int i;
+
+  if (r->n == 0) return;
+
+  r->extents.x1 += dx;
+  r->extents.y1 += dy;
+  r->extents.x2 += dx;
+  r->extents.y2 += dy;
+  if (r->n == 1) return;
+
+  for (i = 0; i < r->n; i++) {
+    r->boxes[i].x1 += dx;
+    r->boxes[i].y1 += dy;
+    r->boxes[i].x2 += dx;
+    r->boxes[i].y2 += dy;
+  }
+}
+
+void region_simplify(struct region *r, int max_boxes) {
+  if (r->n > max_boxes) r->n = 1; // the extents are already up to date
+}
@@ -0,0 +1,44 @@
+#ifndef REGION_H
+#define REGION_H
+
+// A set of pixels stored as y-x banded boxes, the way pixman and X11 do it:
+// boxes are sorted by y then x, the boxes of one band share y1/y2, bands
+// don't overlap and adjacent boxes within a band are merged. Identical
+// bands that touch vertically are merged too, so the representation of a
+// given set of pixels is unique.
+//
+// A zero-initialized struct region is a valid empty region. The very common
+// single-rectangle case lives in `extents` alone and never allocates.
+
+struct box {
+  int x1, y1, x2, y2; // x2 and y2 are exclusive
+};
+
+struct region {
+  struct box extents;
+  int n;          // number of boxes; 0 means empty
+  int capacity;
+  struct box *boxes; // only meaningful when n > 1
+};
+
+void region_init(struct region *r);
+void region_init_rect(struct region *r, int x, int y, int width, int height);
+void region_fini(struct region *r);
+void region_clear(struct region *r);
+int region_copy(struct region *dst, const struct region *src);
+
+// dst may be the same as either operand. They return -1 if out of memory.
+int region_union(struct region *dst, const struct region *a, const struct region *b);
+int region_union_rect(struct region *dst, const struct region *src, int x, int y, int width, int height);
+int region_intersect(struct region *dst, const struct region *a, const struct region *b);
+int region_intersect_rect(struct region *dst, const struct region *src, int x, int y, int width, int height);
+int region_subtract(struct region *dst, const struct region *a, const struct region *b);
+void region_translate(struct region *r, int dx, int dy);
+
+// Replace the region by its bounding box if it has more than max_boxes.
+void region_simplify(struct region *r, int max_boxes);
+
+int region_empty(const struct region *r);
+const struct box *region_boxes(const struct region *r, int *n);
+
+#endif
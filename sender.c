@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sender.h"
+#include "os_compat.h"
+
+struct send {
+  struct sender *sender;
+  struct payload *payload;
+  int fd;
+  loff_t offset;
+  int no_splice;
+  struct event_source *source; // only while waiting for the pipe
+  struct send *next;
+};
+
+struct payload *payload_create(const void *data, size_t len) {
+  struct payload *p = calloc(1, sizeof(*p));
+  const char *src = data;
+  size_t done = 0;
+  ssize_t n;
+
+  if (!p) return NULL;
+
+  p->fd = os_create_anonymous_file(0);
+  if (p->fd < 0) goto fail;
+
+  while (done < len) {
+    n = write(p->fd, src + done, len - done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      goto fail;
+    }
+    done += n;
+  }
+  os_seal_anonymous_file(p->fd);
+
+  p->len = len;
+  p->refs = 1;
+  if (len > 0) {
+    p->data = mmap(NULL, len, PROT_READ, MAP_SHARED, p->fd, 0);
+    if (p->data == MAP_FAILED) goto fail;
+  }
+  return p;
+
+fail:
+  if (p->fd >= 0) close(p->fd);
+  free(p);
+  return NULL;
+}
+
+struct payload *payload_ref(struct payload *p) {
+  p->refs++;
+  return p;
+}
+
+void payload_unref(struct payload *p) {
+  if (!p || --p->refs > 0) return;
+
+  if (p->data) munmap((void *)p->data, p->len);
+  close(p->fd);
+  free(p);
+}
+
+struct sender *sender_create(struct event_loop *loop) {
+  struct sender *s = calloc(1, sizeof(*s));
+
+  if (!s) return NULL;
+  s->loop = loop;
+  return s;
+}
+
+static void finish(struct send *t) {
+  struct send **p;
+
+  for (p = &t->sender->sends; *p; p = &(*p)->next) {
+    if (*p == t) {
+      *p = t->next;
+      break;
+    }
+  }
+  t->sender->count--;
+
+  if (t->source) event_loop_remove(t->source);
+  close(t->fd);
+  payload_unref(t->payload);
+  free(t);
+}
+
+void sender_destroy(struct sender *s) {
+  if (!s) return;
+  while (s->sends) finish(s->sends);
+  free(s);
+}
+
+// 1: all sent, 0: the pipe is full, -1: the receiver is gone
+static int push(struct send *t) {
+  struct payload *p = t->payload;
+  ssize_t n;
+
+  while ((size_t)t->offset < p->len) {
+    if (!t->no_splice) {
+      n = splice(p->fd, &t->offset, t->fd, NULL, p->len - t->offset, SPLICE_F_NONBLOCK);
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        t->no_splice = 1; // not a pipe after all, or an old kernel
+        continue;
+      }
+    } else {
+      n = write(t->fd, p->data + t->offset, p->len - t->offset);
+      if (n > 0) t->offset += n;
+    }
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN ? 0 : -1;
+    }
+    if (n == 0) return -1;
+  }
+  return 1;
+}
+
+static void writable(void *data, int fd, uint32_t events) {
+  struct send *t = data;
+
+  if (push(t) != 0) finish(t);
+}
+
+int sender_send(struct sender *s, struct payload *p, int fd) {
+  struct send *t = calloc(1, sizeof(*t));
+  int ret;
+
+  if (!t) {
+    close(fd);
+    return -1;
+  }
+  t->sender = s;
+  t->payload = payload_ref(p);
+  t->fd = fd;
+  t->next = s->sends;
+  s->sends = t;
+  s->count++;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  // Most payloads fit in the pipe right away
+  ret = push(t);
+  if (ret == 0) {
+    t->source = event_loop_add_fd(s->loop, fd, EPOLLOUT, writable, t);
+    if (t->source) return 0;
+    ret = -1;
+  }
+  finish(t);
+  return ret < 0 ? -1 : 0;
+}
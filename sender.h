@@ -0,0 +1,43 @@
+#ifndef SENDER_H
+#define SENDER_H
+
+#include <stddef.h>
+
+#include "event_loop.h"
+
+// The sending side of the clipboard and drag-and-drop.
+//
+// A payload is kept in a sealed memfd. A wl_data_source.send pipe is fed
+// from it with splice(2), so the bytes go from the page cache to the pipe
+// without passing through our memory (and with plain writes from a
+// mapping where splice doesn't work). The pipe is never waited on: what
+// doesn't fit now is pushed on EPOLLOUT from the event loop, so a slow or
+// stuck receiver costs us nothing.
+//
+// Writing to a pipe whose reader went away raises SIGPIPE: ignore it.
+struct payload {
+  int fd;
+  const char *data; // the memfd, mapped
+  size_t len;
+  int refs;
+};
+
+struct payload *payload_create(const void *data, size_t len);
+struct payload *payload_ref(struct payload *p);
+void payload_unref(struct payload *p);
+
+struct send;
+
+struct sender {
+  struct event_loop *loop;
+  struct send *sends; // in flight
+  int count;
+};
+
+struct sender *sender_create(struct event_loop *loop);
+// Cancels whatever is still in flight
+void sender_destroy(struct sender *s);
+// Writes all of `p` into `fd`, then closes it. Takes the fd (even on failure).
+int sender_send(struct sender *s, struct payload *p, int fd);
+
+#endif
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE // mremap
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include <wayland-client-protocol.h>
+
+#include "os_compat.h"
+#include "shm_pool.h"
+
+static void destroy_buffer(struct shm_buffer *buf) {
+  wl_buffer_destroy(buf->buffer);
+  damage_fini(&buf->damage);
+  buf->buffer = NULL;
+  buf->busy = 0;
+  buf->stale = 0;
+}
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
+  struct shm_buffer *buf = data;
+  struct shm_pool *pool = buf->pool;
+
+  if (buf->stale) {
+    destroy_buffer(buf);
+    return;
+  }
+
+  buf->busy = 0;
+  if (pool->release) pool->release(pool->release_data, buf);
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+  buffer_release
+};
+
+static size_t buffer_size(struct shm_pool *pool) {
+  return (size_t)pool->stride * pool->height;
+}
+
+// Grow the file, the mapping and the compositor's view of the pool.
+// We ask for half as much again as needed so that a drag-resize doesn't
+// come back here on every configure; the pool never shrinks.
+static int grow_pool(struct shm_pool *pool, size_t needed) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (needed + needed / 2 + page - 1) / page * page;
+  void *data;
+
+  if (os_resize_anonymous_file(pool->fd, size) < 0) return -1;
+
+  data = mremap(pool->data, pool->size, size, MREMAP_MAYMOVE);
+  if (data == MAP_FAILED) return -1;
+
+  pool->data = data;
+  pool->size = size;
+  wl_shm_pool_resize(pool->pool, size);
+
+  return 0;
+}
+
+// First fit between the buffers currently carved out of the pool (stale ones
+// included, since the compositor may still be reading them).
+static size_t find_space(struct shm_pool *pool, size_t size) {
+  struct shm_buffer *used[SHM_POOL_MAX_SLOTS], *tmp;
+  size_t offset = 0;
+  int n = 0, i, j;
+
+  for (i = 0; i < SHM_POOL_MAX_SLOTS; i++) {
+    if (pool->buffers[i].buffer) used[n++] = &pool->buffers[i];
+  }
+
+  // sort by offset (there are only a few of them)
+  for (i = 1; i < n; i++) {
+    for (j = i; j > 0 && used[j - 1]->offset > used[j]->offset; j--) {
+      tmp = used[j];
+      used[j] = used[j - 1];
+      used[j - 1] = tmp;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    if (offset + size <= used[i]->offset) break;
+    offset = used[i]->offset + used[i]->size;
+  }
+
+  return offset;
+}
+
+static struct shm_buffer *add_buffer(struct shm_pool *pool) {
+  struct shm_buffer *buf = NULL;
+  size_t offset, size = buffer_size(pool);
+  int i;
+
+  if (pool->nbuffers == SHM_POOL_MAX_BUFFERS) return NULL;
+  for (i = 0; i < SHM_POOL_MAX_SLOTS; i++) {
+    if (!pool->buffers[i].buffer) {
+      buf = &pool->buffers[i];
+      break;
+    }
+  }
+  if (!buf) return NULL;
+
+  offset = find_space(pool, size);
+  if (offset + size > pool->size && grow_pool(pool, offset + size) < 0) {
+    fprintf(stderr, "Could not grow the shm pool: %m\n");
+    return NULL;
+  }
+
+  buf->pool = pool;
+  buf->offset = offset;
+  buf->size = size;
+  buf->busy = 0;
+  buf->stale = 0;
+  damage_clear(&buf->damage);
+  damage_add(&buf->damage, 0, 0, pool->width, pool->height); // nothing painted yet
+  buf->buffer = wl_shm_pool_create_buffer(pool->pool, offset, pool->width, pool->height, pool->stride, pool->format);
+  wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
+  pool->nbuffers++;
+
+  return buf;
+}
+
+struct shm_pool *shm_pool_create(struct wl_shm *shm, int width, int height, uint32_t format, int nbuffers) {
+  struct shm_pool *pool;
+  int i;
+
+  if (nbuffers < 1) nbuffers = 1;
+  if (nbuffers > SHM_POOL_MAX_BUFFERS) nbuffers = SHM_POOL_MAX_BUFFERS;
+
+  pool = calloc(1, sizeof(*pool));
+  if (!pool) return NULL;
+
+  pool->shm = shm;
+  pool->width = width;
+  pool->height = height;
+  pool->stride = width * 4; // 4 bytes/px
+  pool->format = format;
+  pool->size = buffer_size(pool) * nbuffers;
+
+  pool->fd = os_create_anonymous_file(pool->size);
+  if (pool->fd < 0) {
+    fprintf(stderr, "Failed to create a buffer which has the size of %zu\n", pool->size);
+    free(pool);
+    return NULL;
+  }
+
+  pool->data = mmap(NULL, pool->size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+  if (pool->data == MAP_FAILED) {
+    fprintf(stderr, "mmap failed: %m\n");
+    close(pool->fd);
+    free(pool);
+    return NULL;
+  }
+
+  pool->pool = wl_shm_create_pool(shm, pool->fd, pool->size);
+  for (i = 0; i < nbuffers; i++) add_buffer(pool);
+
+  return pool;
+}
+
+void shm_pool_destroy(struct shm_pool *pool) {
+  int i;
+
+  if (!pool) return;
+
+  for (i = 0; i < SHM_POOL_MAX_SLOTS; i++) {
+    if (pool->buffers[i].buffer) destroy_buffer(&pool->buffers[i]);
+  }
+  wl_shm_pool_destroy(pool->pool);
+  munmap(pool->data, pool->size);
+  close(pool->fd);
+  free(pool);
+}
+
+// Switch the pool to a new buffer size without a new fd, mapping or
+// wl_shm_pool. Idle buffers are dropped right away; busy ones are dropped
+// when the compositor releases them. New buffers are carved out lazily by
+// shm_pool_next_buffer(), reusing the existing space when we shrink.
+void shm_pool_resize(struct shm_pool *pool, int width, int height) {
+  struct shm_buffer *buf;
+  int i;
+
+  if (width == pool->width && height == pool->height) return;
+
+  for (i = 0; i < SHM_POOL_MAX_SLOTS; i++) {
+    buf = &pool->buffers[i];
+    if (!buf->buffer || buf->stale) continue;
+
+    if (buf->busy) {
+      buf->stale = 1;
+    } else {
+      destroy_buffer(buf);
+    }
+  }
+
+  pool->nbuffers = 0;
+  pool->width = width;
+  pool->height = height;
+  pool->stride = width * 4;
+}
+
+// Returns a buffer the compositor doesn't hold, adding one to the pool only
+// when all of them are busy. The buffer is marked busy until it is released,
+// so the caller is expected to attach it. NULL means every slot is in flight.
+struct shm_buffer *shm_pool_next_buffer(struct shm_pool *pool) {
+  struct shm_buffer *buf = NULL;
+  int i;
+
+  for (i = 0; i < SHM_POOL_MAX_SLOTS; i++) {
+    if (pool->buffers[i].buffer && !pool->buffers[i].busy && !pool->buffers[i].stale) {
+      buf = &pool->buffers[i];
+      break;
+    }
+  }
+
+  if (!buf) buf = add_buffer(pool);
+  if (!buf) return NULL;
+
+  buf->busy = 1;
+  return buf;
+}
+
+// Something changed on screen: every buffer of the current size has to
+// repaint this area the next time it is used.
+void shm_pool_damage(struct shm_pool *pool, int x, int y, int width, int height) {
+  struct shm_buffer *buf;
+  int i;
+
+  for (i = 0; i < SHM_POOL_MAX_SLOTS; i++) {
+    buf = &pool->buffers[i];
+    if (buf->buffer && !buf->stale) damage_add(&buf->damage, x, y, width, height);
+  }
+}
+
+void *shm_buffer_data(struct shm_buffer *buf) {
+  return (char *)buf->pool->data + buf->offset;
+}
@@ -0,0 +1,59 @@
+#ifndef SHM_POOL_H
+#define SHM_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <wayland-client.h>
+
+#include "damage.h"
+
+// A handful of same-sized wl_buffers carved out of one wl_shm_pool.
+// A buffer handed out by shm_pool_next_buffer() stays busy until the
+// compositor sends wl_buffer.release for it, so we never paint into
+// memory the compositor may still be reading.
+#define SHM_POOL_MAX_BUFFERS 4
+// After a resize the buffers of the old size that are still held by the
+// compositor linger until they are released, hence the extra slots.
+#define SHM_POOL_MAX_SLOTS (SHM_POOL_MAX_BUFFERS * 2)
+
+struct shm_pool;
+
+struct shm_buffer {
+  struct shm_pool *pool;
+  struct wl_buffer *buffer; // NULL if the slot is unused
+  size_t offset; // from the head of the pool (the mapping may move on growth)
+  size_t size;
+  int busy;
+  int stale; // has the old size; destroyed as soon as it is released
+
+  // What has changed since this buffer was last painted. A buffer only has
+  // to be brought up to date in these areas before it is attached again.
+  struct damage damage;
+};
+
+struct shm_pool {
+  struct wl_shm *shm;
+  struct wl_shm_pool *pool;
+  int fd;
+  void *data;
+  size_t size;
+
+  int width, height, stride;
+  uint32_t format;
+
+  struct shm_buffer buffers[SHM_POOL_MAX_SLOTS];
+  int nbuffers; // buffers of the current size
+
+  // called when a buffer becomes free again (optional)
+  void (*release)(void *data, struct shm_buffer *buf);
+  void *release_data;
+};
+
+struct shm_pool *shm_pool_create(struct wl_shm *shm, int width, int height, uint32_t format, int nbuffers);
+void shm_pool_destroy(struct shm_pool *pool);
+void shm_pool_resize(struct shm_pool *pool, int width, int height);
+struct shm_buffer *shm_pool_next_buffer(struct shm_pool *pool);
+void shm_pool_damage(struct shm_pool *pool, int x, int y, int width, int height);
+void *shm_buffer_data(struct shm_buffer *buf);
+
+#endif
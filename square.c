@@ -1,3 +1,5 @@
+// $ gcc -lwayland-client square.c os_compat.c pixel.c event_loop.c
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +11,10 @@
 #include <errno.h>
 #include <unistd.h>
 
+#include "os_compat.h"
+#include "event_loop.h"
+#include "pixel.h"
+
 #define WIDTH 500
 #define HEIGHT 400
 
@@ -18,6 +24,8 @@ struct wl_surface *surface;
 struct wl_shell *shell;
 struct wl_shell_surface *shell_surface;
 struct wl_shm *shm;
+struct wl_callback *frame_callback;
+struct event_loop *loop;
 
 void *shm_data;
 
@@ -41,75 +49,8 @@ struct wl_shell_surface_listener shell_surface_listener = {
   handle_popup_done
 };
 
-// Dealing with tmpfiles
-int set_cloexec_or_close(int fd) {
-  long flags;
-  if (fd == -1) return -1;
-  
-  flags = fcntl(fd, F_GETFD);
-  if (flags == -1) {
-    close(fd);
-    return -1;
-  }
-
-  if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
-    close(fd);
-    return -1;
-  }
-
-  return fd;
-}
-
-int create_tmpfile_cloexec(char *tmpname) {
-#ifdef HAVE_MKOSTEMP
-  int fd = mkostemp(tmpname, O_CLOEXEC);
-  if (fd >= 0) unlink(tmpname);
-#else
-  int fd = mkstemp(tmpname);
-  if (fd >= 0) {
-    fd = set_cloexec_or_close(fd);
-    unlink(tmpname);
-  }
-#endif
-
-  return fd;
-}
-
-int os_create_anonymous_file(off_t size) { // from Weston's implementation
-  static const char template[] = "/weston-shared-XXXXXX";
-  const char *path;
-  char *name;
-  int fd;
-
-  path = getenv("XDG_RUNTIME_DIR");
-  if (!path) {
-    errno = ENOENT;
-    return -1;
-  }
-
-  name = malloc(strlen(path) + sizeof(template));
-  if (!name) return -1;
-  strcpy(name, path);
-  strcat(name, template); // name += template
-
-  fd = create_tmpfile_cloexec(name);
-  free(name);
-  if (fd < 0) return -1;
-  if (ftruncate(fd, size) < 0) {
-    close(fd);
-    return -1;
-  }
-
-  return fd;
-}
-
 void paint_pixels() {
-  int n;
-  uint32_t *pixel = shm_data;
-
-  for (n = 0; n < WIDTH * HEIGHT; n++) {
-    pixel[n = 0xffff;
-  }
+  pixel_fill(shm_data, WIDTH * HEIGHT, 0xffff);
 }
 
 struct wl_buffer *create_buffer() {
@@ -124,6 +65,7 @@ struct wl_buffer *create_buffer() {
     printf("Failed to create a buffer which has the size of %d\n", size);
     exit(1);
   }
+  os_seal_anonymous_file(fd); // this buffer never gets resized
 
   shm_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   if (shm_data == MAP_FAILED) {
@@ -139,9 +81,23 @@ struct wl_buffer *create_buffer() {
   return buffer;
 }
 
+// Under the benchmark (see bench.c) we are done once the square is up.
+void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+  wl_callback_destroy(callback);
+  frame_callback = NULL;
+  if (getenv("BENCH_FRAMES")) event_loop_quit(loop);
+}
+
+static const struct wl_callback_listener frame_listener = {
+  frame_done
+};
+
 void create_window() {
   struct wl_buffer *buffer = create_buffer();
+  paint_pixels();
   wl_surface_attach(surface, buffer, 0, 0);
+  frame_callback = wl_surface_frame(surface);
+  wl_callback_add_listener(frame_callback, &frame_listener, NULL);
   wl_surface_commit(surface);
 }
 
@@ -224,13 +180,17 @@ int main(int argc, char **argv) {
   wl_shell_surface_set_toplevel(shell_surface);
   wl_shell_surface_add_listener(shell_surface, &shell_surface_listener, NULL);
 
+  loop = event_loop_create(display);
+  if (loop == NULL) {
+    perror("Could not create the event loop\n");
+    exit(1);
+  }
+
   create_window();
-  paint_pixels();
 
-  while (wl_display_dispatch(display) != -1) {
-    // do nothing
-  }
+  event_loop_run(loop);
 
+  event_loop_destroy(loop);
   wl_display_disconnect(display);
   printf("disconnected from the display\n");
 
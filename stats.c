@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+
+#include "stats.h"
+
+static struct stats *dump_at_exit;
+
+static int bucket_index(uint64_t v) {
+  int e;
+
+  if (v < 2 * STATS_SUB_HALF) return v;
+
+  e = 63 - __builtin_clzll(v) - STATS_SUB_BITS + 1; // >= 1
+  return e * STATS_SUB_HALF + (v >> e);
+}
+
+// Middle of the range of values that land in bucket i
+static uint64_t bucket_value(int i) {
+  int e;
+
+  if (i < 2 * STATS_SUB_HALF) return i;
+
+  e = i / STATS_SUB_HALF - 1;
+  return ((uint64_t)(i - e * STATS_SUB_HALF) << e) + (((uint64_t)1 << e) - 1) / 2;
+}
+
+void stats_hist_record(struct stats_hist *h, uint64_t value) {
+  h->buckets[bucket_index(value)]++;
+  if (h->count == 0 || value < h->min) h->min = value;
+  if (value > h->max) h->max = value;
+  h->sum += value;
+  h->count++;
+}
+
+uint64_t stats_hist_percentile(const struct stats_hist *h, double percentile) {
+  uint64_t rank, seen = 0, v;
+  int i;
+
+  if (h->count == 0) return 0;
+
+  rank = (uint64_t)(percentile / 100 * h->count + 0.5);
+  if (rank < 1) rank = 1;
+
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) break;
+  }
+
+  // the bucket midpoint may be past what we really saw
+  v = bucket_value(i);
+  if (v < h->min) v = h->min;
+  if (v > h->max) v = h->max;
+  return v;
+}
+
+uint64_t stats_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void exit_handler() {
+  if (dump_at_exit) stats_destroy(dump_at_exit);
+}
+
+struct stats *stats_create(const char *name) {
+  struct stats *s;
+  sigset_t mask;
+
+  s = calloc(1, sizeof(*s));
+  if (!s) return NULL;
+  s->name = name;
+  if (getenv("BENCH_FRAMES")) s->frame_limit = strtoull(getenv("BENCH_FRAMES"), NULL, 10);
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+    free(s);
+    return NULL;
+  }
+
+  s->fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (s->fd < 0) {
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    free(s);
+    return NULL;
+  }
+
+  // so that exit(1) from anywhere still reports
+  if (!dump_at_exit) atexit(exit_handler);
+  dump_at_exit = s;
+
+  return s;
+}
+
+static void dump(struct stats *s) {
+  char *path = getenv("STATS_FILE");
+  FILE *f;
+
+  if (!path) {
+    stats_dump(s, stderr);
+    return;
+  }
+
+  f = fopen(path, "w");
+  if (!f) {
+    perror("Could not open $STATS_FILE");
+    return;
+  }
+  stats_dump(s, f);
+  fclose(f);
+}
+
+void stats_destroy(struct stats *s) {
+  if (!s) return;
+
+  dump(s);
+  if (dump_at_exit == s) dump_at_exit = NULL;
+  close(s->fd);
+  free(s);
+}
+
+int stats_get_fd(struct stats *s) {
+  return s->fd;
+}
+
+int stats_handle_signal(struct stats *s) {
+  struct signalfd_siginfo si;
+
+  while (read(s->fd, &si, sizeof(si)) == sizeof(si)) {
+    if (si.ssi_signo != SIGUSR1) return -1;
+    dump(s);
+  }
+
+  return 0;
+}
+
+static void dump_hist(FILE *f, const char *name, const struct stats_hist *h) {
+  fprintf(f, "  \"%s\": { \"count\": %llu, \"min\": %.1f, \"mean\": %.1f, "
+             "\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f }",
+          name, (unsigned long long)h->count, h->min / 1000.0,
+          h->count ? (double)h->sum / h->count / 1000.0 : 0.0,
+          stats_hist_percentile(h, 50) / 1000.0,
+          stats_hist_percentile(h, 99) / 1000.0,
+          stats_hist_percentile(h, 99.9) / 1000.0,
+          h->max / 1000.0);
+}
+
+// Times in microseconds. fps only counts from the first frame on, so
+// startup doesn't weigh in.
+void stats_dump(struct stats *s, FILE *f) {
+  uint64_t elapsed = s->last_frame - s->first_frame;
+
+  fprintf(f, "{\n  \"program\": \"%s\",\n", s->name);
+  fprintf(f, "  \"frames\": %llu,\n", (unsigned long long)s->frames);
+  fprintf(f, "  \"fps\": %.1f,\n", elapsed ? (s->frames - 1) * 1e9 / elapsed : 0.0);
+  fprintf(f, "  \"dropped\": %llu,\n", (unsigned long long)s->dropped);
+  dump_hist(f, "paint_us", &s->paint);
+  fprintf(f, ",\n");
+  dump_hist(f, "latency_us", &s->latency);
+  fprintf(f, ",\n");
+  dump_hist(f, "dispatch_us", &s->dispatch);
+  fprintf(f, "\n}\n");
+  fflush(f);
+}
+
+void stats_paint_begin(struct stats *s) {
+  s->paint_start = stats_now();
+}
+
+void stats_commit(struct stats *s) {
+  s->commit_time = stats_now();
+  if (s->paint_start) stats_hist_record(&s->paint, s->commit_time - s->paint_start);
+  s->paint_start = 0;
+}
+
+int stats_frame_done(struct stats *s) {
+  uint64_t now = stats_now();
+
+  s->frames++;
+  if (!s->first_frame) s->first_frame = now;
+  s->last_frame = now;
+  if (s->commit_time) stats_hist_record(&s->latency, now - s->commit_time);
+  s->commit_time = 0;
+
+  return s->frame_limit && s->frames >= s->frame_limit;
+}
+
+void stats_dispatch_begin(struct stats *s) {
+  s->dispatch_start = stats_now();
+}
+
+void stats_dispatch_end(struct stats *s) {
+  stats_hist_record(&s->dispatch, stats_now() - s->dispatch_start);
+}
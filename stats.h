@@ -0,0 +1,65 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Always-on frame timing, cheap enough to leave in production builds.
+//
+// Every measurement goes into a fixed-size log-linear histogram (the
+// HdrHistogram layout): values below 2^STATS_SUB_BITS get a bucket each,
+// above that every power of two is split into 2^(STATS_SUB_BITS - 1)
+// buckets, so any value is known within 1/64 (1.6%) without ever
+// allocating. Times are in nanoseconds.
+//
+// SIGUSR1 dumps the numbers as JSON, and so does exiting. They go to
+// stderr, or to the file named by $STATS_FILE.
+//
+// $BENCH_FRAMES=n makes stats_frame_done() report the end of the run after
+// n frames, for the benchmark harness (see bench.c).
+#define STATS_SUB_BITS 7
+#define STATS_SUB_HALF (1 << (STATS_SUB_BITS - 1))
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 2) * STATS_SUB_HALF)
+
+struct stats_hist {
+  uint64_t count, sum, min, max;
+  uint32_t buckets[STATS_BUCKETS];
+};
+
+void stats_hist_record(struct stats_hist *h, uint64_t value);
+uint64_t stats_hist_percentile(const struct stats_hist *h, double percentile);
+
+struct stats {
+  const char *name;
+
+  struct stats_hist paint;    // redraw() until the buffer is committed
+  struct stats_hist latency;  // commit until its frame callback
+  struct stats_hist dispatch; // reading and dispatching one batch of events
+  uint64_t frames;
+  uint64_t dropped;           // refreshes missed or frames discarded, see frame_sched
+  uint64_t frame_limit;       // 0: none
+  uint64_t first_frame, last_frame; // frame callback times, for fps
+
+  uint64_t paint_start, commit_time, dispatch_start; // 0: nothing going on
+  int fd;
+};
+
+// Blocks SIGUSR1, SIGINT and SIGTERM and hands them over through
+// stats_get_fd() instead. Call before starting any thread so they all
+// inherit the mask.
+struct stats *stats_create(const char *name);
+void stats_destroy(struct stats *s); // dumps one last time
+int stats_get_fd(struct stats *s);
+// After the fd polled readable. Returns -1 when we were asked to quit.
+int stats_handle_signal(struct stats *s);
+void stats_dump(struct stats *s, FILE *f);
+
+uint64_t stats_now();
+
+void stats_paint_begin(struct stats *s);
+void stats_commit(struct stats *s);
+int stats_frame_done(struct stats *s); // 1 once $BENCH_FRAMES frames are done
+void stats_dispatch_begin(struct stats *s);
+void stats_dispatch_end(struct stats *s);
+
+#endif
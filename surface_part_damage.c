@@ -1,3 +1,7 @@
+// $ gcc -lwayland-client surface_part_damage.c shm_pool.c os_compat.c pixel.c damage.c region.c raster.c frame_sched.c stats.c log.c event_loop.c presentation-time-protocol.c -lpthread
+// $ wayland-scanner client-header /usr/share/wayland-protocols/stable/presentation-time/presentation-time.xml presentation-time-client-protocol.h
+// $ wayland-scanner private-code /usr/share/wayland-protocols/stable/presentation-time/presentation-time.xml presentation-time-protocol.c
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,24 +13,40 @@
 #include <errno.h>
 #include <unistd.h>
 
+#include "shm_pool.h"
+#include "pixel.h"
+#include "damage.h"
+#include "raster.h"
+#include "frame_sched.h"
+#include "stats.h"
+#include "log.h"
+#include "event_loop.h"
+
 #define WIDTH 500
 #define HEIGHT 400
 
 struct wl_display *display;
 struct wl_compositor *compositor;
+uint32_t compositor_version;
 struct wl_surface *surface;
 struct wl_shell *shell;
 struct wl_shell_surface *shell_surface;
 struct wl_shm *shm;
-struct wl_buffer *buffer;
+struct shm_pool *pool;
 struct wl_callback *frame_callback;
+struct wp_presentation *presentation;
+struct frame_sched *sched;
+struct stats *stats;
+struct event_loop *loop;
 
-void *shm_data;
+int waiting_for_buffer;
+struct raster *raster;
+struct shm_buffer *painting; // submitted to the raster, not committed yet
 
 // Shell surface listeners
 void handle_ping(void *data, struct wl_shell_surface *shell_surface, uint32_t serial) {
   wl_shell_surface_pong(shell_surface, serial);
-  printf("Pong\n");
+  log_debug("Pong\n");
 }
 
 void handle_configure(void *data, struct wl_shell_surface *shell_surface, uint32_t edges, int32_t width, int32_t height) {
@@ -43,143 +63,136 @@ struct wl_shell_surface_listener shell_surface_listener = {
   handle_popup_done
 };
 
-// Dealing with tmpfiles
-int set_cloexec_or_close(int fd) {
-  long flags;
-  if (fd == -1) return -1;
-  
-  flags = fcntl(fd, F_GETFD);
-  if (flags == -1) {
-    close(fd);
-    return -1;
-  }
+int pixel_value = 0x0;
 
-  if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
-    close(fd);
-    return -1;
-  }
+// What the surface is supposed to look like: the rows above `ht` take the
+// new color every frame, the ones below keep whatever they had last.
+uint32_t row_color[HEIGHT];
+uint32_t ht;
+struct damage frame_damage; // what changed since the previous commit
 
-  return fd;
-}
+void update_scene() {
+  int y;
 
-int create_tmpfile_cloexec(char *tmpname) {
-#ifdef HAVE_MKOSTEMP
-  int fd = mkostemp(tmpname, O_CLOEXEC);
-  if (fd >= 0) unlink(tmpname);
-#else
-  int fd = mkstemp(tmpname);
-  if (fd >= 0) {
-    fd = set_cloexec_or_close(fd);
-    unlink(tmpname);
+  // damage the entire surface:
+  // damage_add(&frame_damage, 0, 0, WIDTH, HEIGHT);
+  // damage the partial surface:
+  if (ht == 0) ht = HEIGHT;
+  for (y = 0; y < ht; y++) row_color[y] = pixel_value;
+  damage_add(&frame_damage, 0, 0, WIDTH, ht); // for the compositor
+  shm_pool_damage(pool, 0, 0, WIDTH, ht); // for each of our buffers
+  ht--;
+
+  pixel_value += 0x01010101;
+  if (pixel_value > 0xffffffff) {
+    pixel_value = 0x0;
   }
-#endif
+}
+
+static const struct wl_callback_listener frame_listener;
+
+// The raster is done with the tiles of `painting`: hand it over.
+void commit_frame() {
+  struct shm_buffer *buf = painting;
 
-  return fd;
+  painting = NULL;
+  damage_send(&frame_damage, surface, compositor_version);
+  frame_sched_commit(sched, surface);
+  stats_commit(stats);
+  damage_clear(&frame_damage);
+
+  frame_callback = wl_surface_frame(surface);
+  wl_surface_attach(surface, buf->buffer, 0, 0);
+  wl_callback_add_listener(frame_callback, &frame_listener, NULL);
+  wl_surface_commit(surface);
 }
 
-int os_create_anonymous_file(off_t size) { // from Weston's implementation
-  static const char template[] = "/weston-shared-XXXXXX";
-  const char *path;
-  char *name;
-  int fd;
+void paint_tile(void *data, const struct box *tile) {
+  struct shm_buffer *buf = data;
+  uint32_t *pixel = shm_buffer_data(buf);
+  int y;
 
-  path = getenv("XDG_RUNTIME_DIR");
-  if (!path) {
-    errno = ENOENT;
-    return -1;
+  for (y = tile->y1; y < tile->y2; y++) {
+    pixel_fill(pixel + y * WIDTH + tile->x1, tile->x2 - tile->x1, row_color[y]);
   }
+}
 
-  name = malloc(strlen(path) + sizeof(template));
-  if (!name) return -1;
-  strcpy(name, path);
-  strcat(name, template); // name += template
-
-  fd = create_tmpfile_cloexec(name);
-  free(name);
-  if (fd < 0) return -1;
-  if (ftruncate(fd, size) < 0) {
-    close(fd);
-    return -1;
+// Only rasterize what this buffer has missed since it was last attached.
+// The tiles are painted on the raster threads; the dispatch thread goes
+// back to handling events and commits when raster_get_fd() fires.
+void paint_pixels(struct shm_buffer *buf) {
+  const struct box *b;
+  int i, n;
+
+  painting = buf;
+  b = damage_boxes(&buf->damage, &n);
+  if (raster_submit(raster, b, n, paint_tile, buf) < 0) {
+    for (i = 0; i < n; i++) paint_tile(buf, &b[i]);
+    damage_clear(&buf->damage);
+    commit_frame();
+    return;
   }
-
-  return fd;
+  damage_clear(&buf->damage); // the raster has its own copy of the boxes
 }
 
-int pixel_value = 0x0;
+void redraw(void *data, struct wl_callback *callback, uint32_t time) {
+  struct shm_buffer *buf;
 
-void paint_pixels() {
-  int n;
-  uint32_t *pixel = shm_data;
+  if (frame_callback) wl_callback_destroy(frame_callback);
+  frame_callback = NULL;
 
-  for (n = 0; n < WIDTH * HEIGHT; n++) {
-    pixel[n] = pixel_value; // black
+  buf = shm_pool_next_buffer(pool);
+  if (buf == NULL) {
+    // the compositor holds every buffer; buffer_released() picks it up again
+    waiting_for_buffer = 1;
+    return;
   }
 
-  pixel_value += 0x01010101;
-  if (pixel_value > 0xffffffff) {
-    pixel_value = 0x0;
-  }
+  update_scene();
+  frame_sched_begin(sched);
+  stats_paint_begin(stats);
+  paint_pixels(buf); // commit_frame() follows once the tiles are done
 }
 
-static const struct wl_callback_listener frame_listener;
-
-uint32_t ht;
+// Don't paint yet: the scheduler knows when the next vblank is and starts
+// us as late as it safely can (see frame_sched.h).
+void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+  wl_callback_destroy(callback);
+  frame_callback = NULL;
 
-void redraw(void *data, struct wl_callback *callback, uint32_t time) {
-  wl_callback_destroy(frame_callback);
-  // damage the entire surface:
-  // wl_surface_damage(surface, 0, 0, WIDTH, HEIGHT);
-  // damage the partial surface:
-  if (ht == 0) ht = HEIGHT;
-  wl_surface_damage(surface, 0, 0, WIDTH, ht--);
-  paint_pixels();
-  frame_callback = wl_surface_frame(surface);
-  wl_surface_attach(surface, buffer, 0, 0);
-  wl_callback_add_listener(frame_callback, &frame_listener, NULL);
-  wl_surface_commit(surface);
+  stats->dropped = sched->missed + sched->discarded;
+  if (stats_frame_done(stats)) {
+    event_loop_quit(loop);
+    return;
+  }
+  if (frame_sched_schedule(sched)) redraw(NULL, NULL, time);
 }
 
 static const struct wl_callback_listener frame_listener = {
-  redraw
+  frame_done
 };
 
-struct wl_buffer *create_buffer() {
-  struct wl_shm_pool *pool;
-  int line = WIDTH * 4; // 4 bytes/px
-  int size = line * HEIGHT;
-  int fd;
-  struct wl_buffer *buf;
-
-  ht = HEIGHT;
-
-  fd = os_create_anonymous_file(size);
-  if (fd < 0) {
-    printf("Failed to create a buffer which has the size of %d\n", size);
-    exit(1);
+void buffer_released(void *data, struct shm_buffer *buf) {
+  if (waiting_for_buffer) {
+    waiting_for_buffer = 0;
+    redraw(NULL, NULL, 0);
   }
+}
 
-  shm_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (shm_data == MAP_FAILED) {
-    printf("mmap failed: %m\n");
-    close(fd);
-    exit(1);
-  }
-
-  pool = wl_shm_create_pool(shm, fd, size);
-  buf = wl_shm_pool_create_buffer(pool, 0, WIDTH, HEIGHT, line, WL_SHM_FORMAT_ARGB8888);
-
-  wl_shm_pool_destroy(pool);
-  return buf;
+struct shm_pool *create_pool() {
+  struct shm_pool *p = shm_pool_create(shm, WIDTH, HEIGHT, WL_SHM_FORMAT_ARGB8888, 2); // double buffering
+  if (p == NULL) exit(1);
+  p->release = buffer_released;
+  return p;
 }
 
 void create_window() {
-  buffer = create_buffer();
-  wl_surface_attach(surface, buffer, 0, 0);
-  wl_surface_commit(surface);
+  ht = HEIGHT;
+  pool = create_pool();
 }
 
 void shm_format(void *data, struct wl_shm *wl_shm, uint32_t format) {
-  printf("Format %d\n", format);
+  log_debug("Format %d\n", format);
 }
 
 struct wl_shm_listener shm_listener = {
@@ -187,15 +200,21 @@ struct wl_shm_listener shm_listener = {
 };
 
 void global_add(void *data, struct wl_registry *registry, uint32_t id, const char *interface, uint32_t version) {
-  printf("Added: %s, %d\n", interface, id);
+  log_debug("Added: %s, %d\n", interface, id);
   if (strcmp(interface, "wl_compositor") == 0) {
-    compositor = wl_registry_bind(registry, id, &wl_compositor_interface, 1);
+    compositor_version = version < 4 ? version : 4; // 4 for wl_surface.damage_buffer
+    compositor = wl_registry_bind(registry, id, &wl_compositor_interface, compositor_version);
   }
 
   if (strcmp(interface, "wl_shell") == 0) {
     shell = wl_registry_bind(registry, id, &wl_shell_interface, 1);
   }
 
+  if (strcmp(interface, "wp_presentation") == 0) {
+    presentation = wl_registry_bind(registry, id, &wp_presentation_interface, 1);
+    frame_sched_set_presentation(sched, presentation);
+  }
+
   if (strcmp(interface, "wl_shm") == 0) {
     shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
     wl_shm_add_listener(shm, &shm_listener, NULL);
@@ -203,7 +222,7 @@ void global_add(void *data, struct wl_registry *registry, uint32_t id, const cha
 }
 
 void global_remove(void *data, struct wl_registry *registry, uint32_t id) {
-  printf("Removed: %d\n", id);
+  log_debug("Removed: %d\n", id);
 }
 
 struct wl_registry_listener registry_listener = {
@@ -211,7 +230,33 @@ struct wl_registry_listener registry_listener = {
   .global_remove = global_remove
 };
 
+// Event loop sources
+void raster_ready(void *data, int fd, uint32_t events) {
+  if (raster_finish(raster)) commit_frame();
+}
+
+void sched_ready(void *data, int fd, uint32_t events) {
+  if (frame_sched_ready(sched)) redraw(NULL, NULL, 0);
+}
+
+void stats_signal(void *data, int fd, uint32_t events) {
+  if (stats_handle_signal(stats) < 0) event_loop_quit(loop);
+}
+
+void dispatch_observer(void *data, int phase) {
+  if (phase == EVENT_LOOP_DISPATCH_BEGIN) stats_dispatch_begin(stats);
+  else stats_dispatch_end(stats);
+}
+
 int main(int argc, char **argv) {
+  // before any thread gets started, see stats_create()
+  stats = stats_create("surface_part_damage");
+  if (stats == NULL) {
+    perror("Could not set up the frame statistics\n");
+    exit(1);
+  }
+  if (log_init() < 0) perror("Could not start the log thread, logging synchronously\n");
+
   display = wl_display_connect(NULL);
   if (display == NULL) {
     perror("Can't connect to the display\n");
@@ -219,6 +264,13 @@ int main(int argc, char **argv) {
   }
   printf("connected to the display\n");
 
+  char *margin = getenv("FRAME_MARGIN_US"); // how long before the vblank we must have committed
+  sched = frame_sched_create(margin ? atoi(margin) : 0);
+  if (sched == NULL) {
+    perror("Could not create the frame scheduler\n");
+    exit(1);
+  }
+
   struct wl_registry *registry = wl_display_get_registry(display);
   wl_registry_add_listener(registry, &registry_listener, NULL);
   
@@ -260,13 +312,32 @@ int main(int argc, char **argv) {
   frame_callback = wl_surface_frame(surface);
   wl_callback_add_listener(frame_callback, &frame_listener, NULL);
 
+  raster = raster_create(0);
+  if (raster == NULL) {
+    perror("Could not start the raster threads\n");
+    exit(1);
+  }
+
+  loop = event_loop_create(display);
+  if (loop == NULL ||
+      !event_loop_add_fd(loop, raster_get_fd(raster), EPOLLIN, raster_ready, NULL) ||
+      !event_loop_add_fd(loop, frame_sched_get_fd(sched), EPOLLIN, sched_ready, NULL) ||
+      !event_loop_add_fd(loop, stats_get_fd(stats), EPOLLIN, stats_signal, NULL)) {
+    perror("Could not create the event loop\n");
+    exit(1);
+  }
+  event_loop_set_observer(loop, dispatch_observer, NULL);
+
   create_window();
   redraw(NULL, NULL, 0);
 
-  while (wl_display_dispatch(display) != -1) {
-    // do nothing
-  }
+  event_loop_run(loop);
 
+  event_loop_destroy(loop);
+  raster_destroy(raster);
+  frame_sched_destroy(sched);
+  if (presentation) wp_presentation_destroy(presentation);
+  stats_destroy(stats);
   wl_display_disconnect(display);
   printf("disconnected from the display\n");
 
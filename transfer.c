@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "transfer.h"
+
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_SEC 1000000000ull
+
+static uint64_t now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Wake up for the earliest deadline
+static void arm(struct transfers *m) {
+  struct transfer *t;
+  uint64_t at = 0;
+
+  for (t = m->active; t; t = t->next) {
+    if (at == 0 || t->deadline < at) at = t->deadline;
+  }
+  if (at == m->timer_at) return;
+
+  m->timer_at = at;
+  if (at) event_loop_timer_arm(m->timer, at, 0, 1);
+  else event_loop_timer_disarm(m->timer);
+}
+
+// Calls back and recycles `t`
+static void finish(struct transfer *t, int status) {
+  struct transfers *m = t->manager;
+  struct transfer **p;
+
+  for (p = &m->active; *p; p = &(*p)->next) {
+    if (*p == t) {
+      *p = t->next;
+      break;
+    }
+  }
+  m->count--;
+
+  event_loop_remove(t->source);
+  close(t->fd);
+  t->func(t->data, t, status);
+
+  if (m->pooled < TRANSFER_POOL_MAX) {
+    // the buffer stays for the next one, if it's a small one
+    if (t->receive.capacity > TRANSFER_POOL_BUFFER) receive_fini(&t->receive);
+    else receive_reset(&t->receive);
+    t->next = m->pool;
+    m->pool = t;
+    m->pooled++;
+  } else {
+    receive_fini(&t->receive);
+    free(t);
+  }
+}
+
+static void readable(void *data, int fd, uint32_t events) {
+  struct transfer *t = data;
+  size_t before = t->receive.len;
+  int ret = receive_read(&t->receive, fd);
+
+  if (ret != 0) {
+    finish(t, ret > 0 ? TRANSFER_DONE : TRANSFER_FAILED);
+    return;
+  }
+  // stalled means no progress; the timer catches up with it lazily
+  if (t->receive.len != before) t->deadline = now() + t->manager->timeout;
+}
+
+// A callback may start or cancel other transfers: start over after each
+static void expire(void *data, uint64_t expirations) {
+  struct transfers *m = data;
+  struct transfer *t;
+  uint64_t n = now();
+
+  m->timer_at = 0;
+again:
+  for (t = m->active; t; t = t->next) {
+    if (t->deadline <= n) {
+      finish(t, TRANSFER_TIMED_OUT);
+      goto again;
+    }
+  }
+  arm(m);
+}
+
+struct transfers *transfers_create(struct event_loop *loop, int timeout_ms, size_t spill_threshold) {
+  struct transfers *m = calloc(1, sizeof(*m));
+
+  if (!m) return NULL;
+  m->loop = loop;
+  m->timeout = (timeout_ms > 0 ? timeout_ms : TRANSFER_DEFAULT_TIMEOUT_MS) * NSEC_PER_MSEC;
+  m->spill_threshold = spill_threshold;
+
+  m->timer = event_loop_add_timer(loop, CLOCK_MONOTONIC, expire, m);
+  if (!m->timer) {
+    free(m);
+    return NULL;
+  }
+  return m;
+}
+
+void transfers_destroy(struct transfers *m) {
+  struct transfer *t;
+
+  if (!m) return;
+  while (m->active) finish(m->active, TRANSFER_CANCELLED);
+  while ((t = m->pool)) {
+    m->pool = t->next;
+    receive_fini(&t->receive);
+    free(t);
+  }
+  event_loop_remove(m->timer);
+  free(m);
+}
+
+struct transfer *transfers_receive(struct transfers *m, struct wl_data_offer *offer, const char *mime, transfer_func func, void *data) {
+  struct transfer *t;
+  int fd[2];
+
+  if (strlen(mime) >= TRANSFER_MIME_MAX) return NULL;
+  if (pipe2(fd, O_CLOEXEC) < 0) return NULL;
+
+  if (m->pool) {
+    t = m->pool;
+    m->pool = t->next;
+    m->pooled--;
+  } else {
+    t = calloc(1, sizeof(*t));
+    if (!t) goto fail;
+    receive_init(&t->receive, m->spill_threshold);
+  }
+
+  // only our end: the source client may well expect a blocking pipe
+  fcntl(fd[0], F_SETFL, O_NONBLOCK);
+  t->source = event_loop_add_fd(m->loop, fd[0], EPOLLIN, readable, t);
+  if (!t->source) {
+    receive_fini(&t->receive);
+    free(t);
+    goto fail;
+  }
+
+  t->manager = m;
+  t->offer = offer;
+  strcpy(t->mime, mime);
+  t->fd = fd[0];
+  t->func = func;
+  t->data = data;
+  t->deadline = now() + m->timeout;
+  t->next = m->active;
+  m->active = t;
+  m->count++;
+
+  wl_data_offer_receive(offer, mime, fd[1]);
+  close(fd[1]); // the source client has its own copy now
+
+  if (m->timer_at == 0 || t->deadline < m->timer_at) arm(m);
+  return t;
+
+fail:
+  close(fd[0]);
+  close(fd[1]);
+  return NULL;
+}
+
+void transfers_cancel(struct transfers *m, struct wl_data_offer *offer) {
+  struct transfer *t;
+
+again:
+  for (t = m->active; t; t = t->next) {
+    if (t->offer == offer) {
+      t->offer = NULL;
+      finish(t, TRANSFER_CANCELLED);
+      goto again;
+    }
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+#include "event_loop.h"
+#include "receive.h"
+
+// Any number of wl_data_offer.receive transfers in flight on the event
+// loop, each with its own state: the pipe, what came so far, the MIME
+// type and a completion callback. Finished transfers go back to a small
+// pool and keep their buffer for the next one, unless it grew past
+// TRANSFER_POOL_BUFFER: a big paste must not stay pinned with nothing in
+// flight.
+//
+// A source that sends nothing for `timeout_ms` is given up on. When an
+// offer is replaced, transfers_cancel() drops whatever was still coming
+// from it. Every transfer ends with exactly one call of its callback.
+#define TRANSFER_DEFAULT_TIMEOUT_MS 10000
+#define TRANSFER_POOL_MAX 8
+#define TRANSFER_POOL_BUFFER (4 * RECEIVE_CHUNK) // bytes kept per pooled transfer
+#define TRANSFER_MIME_MAX 64
+
+#define TRANSFER_DONE 1
+#define TRANSFER_CANCELLED 0
+#define TRANSFER_FAILED -1
+#define TRANSFER_TIMED_OUT -2
+
+struct transfer;
+// On TRANSFER_DONE the payload is in t->receive; it's gone after the call
+typedef void (*transfer_func)(void *data, struct transfer *t, int status);
+
+struct transfer {
+  struct transfers *manager;
+  struct wl_data_offer *offer; // NULL: not cancelled along with it
+  char mime[TRANSFER_MIME_MAX];
+  int fd;
+  struct event_source *source;
+  struct receive receive;
+  uint64_t deadline; // CLOCK_MONOTONIC ns
+
+  transfer_func func;
+  void *data;
+  struct transfer *next;
+};
+
+struct transfers {
+  struct event_loop *loop;
+  struct event_source *timer;
+  uint64_t timer_at; // 0: disarmed
+  uint64_t timeout;
+  size_t spill_threshold;
+
+  struct transfer *active, *pool;
+  int count, pooled;
+};
+
+struct transfers *transfers_create(struct event_loop *loop, int timeout_ms, size_t spill_threshold);
+// Cancels what's still in flight
+void transfers_destroy(struct transfers *m);
+// Asks `offer` for `mime` and collects it
+struct transfer *transfers_receive(struct transfers *m, struct wl_data_offer *offer, const char *mime, transfer_func func, void *data);
+// Every transfer from `offer`, before it gets destroyed
+void transfers_cancel(struct transfers *m, struct wl_data_offer *offer);
+
+#endif